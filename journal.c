@@ -1,38 +1,75 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #define FS_MAGIC 0x56534653U
 #define JOURNAL_MAGIC 0x4A524E4CU
 
-#define BLOCK_SIZE        4096U
+/*
+ * The block size is chosen by mkfs and read from the superblock when an
+ * image is opened; everything sized in blocks is derived from it.
+ */
+#define MIN_BLOCK_SIZE     1024U
+#define MAX_BLOCK_SIZE    65536U
+#define BLOCK_SIZE        block_size
 #define INODE_SIZE         128U
-#define JOURNAL_BLOCK_IDX    1U
-#define JOURNAL_BLOCKS      16U
-#define INODE_BLOCKS         2U
-#define DATA_BLOCKS         64U
-#define INODE_BMAP_IDX     (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
-#define DATA_BMAP_IDX      (INODE_BMAP_IDX + 1U)
-#define INODE_START_IDX    (DATA_BMAP_IDX + 1U)
-#define DATA_START_IDX     (INODE_START_IDX + INODE_BLOCKS)
-#define TOTAL_BLOCKS       (DATA_START_IDX + DATA_BLOCKS)
+#define BITS_PER_BLOCK     (BLOCK_SIZE * 8U)
 #define DIRECT_POINTERS     8U
 #define NAME_LEN           28
 #define DEFAULT_IMAGE "vsfs.img"
 
-#define JOURNAL_SIZE (JOURNAL_BLOCKS * BLOCK_SIZE)
-
 #define REC_DATA   1
 #define REC_COMMIT 2
+#define REC_REVOKE 3
 
 #define INODE_FREE 0
 #define INODE_FILE 1
 #define INODE_DIR  2
+
+#define INODE_FLAG_INDEX 0x1U
+#define INODE_FLAG_BLOOM 0x2U
+#define INODE_FLAG_EXTENTS 0x4U
+#define INODE_FLAG_INLINE  0x8U
+
+#define INODES_PER_BLOCK   (BLOCK_SIZE / INODE_SIZE)
+#define DIRENTS_PER_BLOCK  (BLOCK_SIZE / sizeof(struct dirent))
+
+#define DIR_BLOOM_BYTES    64U
+#define DIR_BLOOM_HASHES    3U
+
+#define EXTENT_MAGIC      0xE47AU
+#define EXTENT_MAX_LEN    0xFFFFU
+#define EXTENT_ROOT_ENTRIES ((DIRECT_POINTERS * 4 - sizeof(struct extent_header)) / sizeof(struct extent))
+#define EXTENT_LEAF_ENTRIES ((BLOCK_SIZE - sizeof(struct extent_header)) / sizeof(struct extent))
+
+#define DX_ROOT_MAGIC 0x44585254U
+#define DX_LEAF_MAGIC 0x44584C46U
+#define DX_MIN_ENTRIES     64U
+/* The root's leaf table, 1 << depth entries after an 8-byte header, must fit in one block. */
+#define DX_MAX_DEPTH       (BLOCK_SIZE >= 4096U ? 9U : BLOCK_SIZE >= 2048U ? 8U : 7U)
+#define DX_LEAF_ENTRIES    ((BLOCK_SIZE - 16) / sizeof(struct dx_entry))
+
+#define GROUP_DESCS_PER_BLOCK (BLOCK_SIZE / sizeof(struct group_desc))
+#define GROUP_INODE_UNINIT 0x1U
+
+#define FEATURE_64BIT      0x1U
+#define FEATURE_DISCARD    0x2U
+#define FEATURE_KNOWN      (FEATURE_64BIT | FEATURE_DISCARD)
+#define MAX_64BIT_BLOCKS   (1ULL << 48)
+#define JOURNAL_BLOCK_IDX  1U
+
 struct superblock {
     uint32_t magic;
     uint32_t block_size;
@@ -45,7 +82,85 @@ struct superblock {
     uint32_t inode_start;
     uint32_t data_start;
 
-    uint8_t  _pad[128 - 9 * 4];
+    /* Region sizes chosen by mkfs; the layout is derived from these. */
+    uint32_t journal_blocks;
+    uint32_t inode_bitmap_blocks;
+    uint32_t data_bitmap_blocks;
+    uint32_t data_blocks;
+
+    /*
+     * Block groups: group g owns inodes [g * inodes_per_group, ...) and
+     * data blocks [g * blocks_per_group, ...), and its free counts and
+     * flags live in the group descriptor table at group_desc.
+     */
+    uint32_t group_count;
+    uint32_t inodes_per_group;
+    uint32_t blocks_per_group;
+    uint32_t group_desc;
+    uint32_t group_desc_blocks;
+
+    /*
+     * FEATURE_64BIT: the _hi words carry the upper halves of the block
+     * counts. Only file data extents may point past
+     * block 2^32; every other block pointer stays 32-bit.
+     * FEATURE_DISCARD: freed data blocks and installed journal records
+     * are punched out of the image file.
+     */
+    uint32_t features;
+    uint32_t total_blocks_hi;
+    uint32_t data_blocks_hi;
+
+    /*
+     * Next-fit cursors as of the last install. Each commit record carries
+     * the current ones, so they cost no journal block; install copies the
+     * last into the superblock.
+     */
+    uint32_t next_inode;
+    uint32_t next_block;
+    uint32_t next_block_hi;
+
+    uint8_t  _pad[128 - 24 * 4];
+};
+
+/*
+ * The free counts are the only ones on disk. Allocation keeps them in
+ * memory without logging them; fs_open and install recount the groups
+ * whose bitmap blocks sit in the journal. GROUP_INODE_UNINIT marks a
+ * group whose inode-table slice was never zeroed.
+ */
+struct group_desc {
+    uint32_t free_inodes;
+    uint32_t free_blocks;
+    uint32_t dirs;
+    uint32_t flags;
+};
+
+/*
+ * Extent block map. The root (header plus EXTENT_ROOT_ENTRIES entries)
+ * lives in the inode in place of the direct pointers. At depth 0 the
+ * entries are extents; at depth 1 they index leaf blocks of extents.
+ * In 64-bit images start_hi holds bits 32-47 of an extent's start;
+ * leaf_hi is reserved, since leaf blocks always sit below 2^32.
+ */
+struct extent_header {
+    uint16_t magic;
+    uint16_t entries;
+    uint16_t max;
+    uint16_t depth;
+};
+
+struct extent {
+    uint32_t logical;
+    uint16_t len;
+    uint16_t start_hi;
+    uint32_t start;
+};
+
+struct extent_idx {
+    uint32_t logical;
+    uint32_t leaf;
+    uint16_t leaf_hi;
+    uint16_t unused;
 };
 
 struct inode {
@@ -53,87 +168,630 @@ struct inode {
     uint16_t links;
     uint32_t size;
 
-    uint32_t direct[DIRECT_POINTERS];
+    union {
+        uint32_t direct[DIRECT_POINTERS];
+        uint8_t extent_root[DIRECT_POINTERS * 4];
+    };
 
     uint32_t ctime;
     uint32_t mtime;
 
-    uint8_t _pad[128 - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4)];
+    uint32_t flags;
+
+    /* Directory-only fields; inline files use the space for their tail. */
+    union {
+        struct {
+            uint32_t dx_root;
+            uint8_t bloom[DIR_BLOOM_BYTES];
+        };
+        uint8_t inline_tail[4 + DIR_BLOOM_BYTES];
+    };
+
+    /* Directories: every entry slot below this one is in use. */
+    uint32_t free_hint;
+
+    uint8_t _pad[128 - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4 + 4 + 4 + DIR_BLOOM_BYTES + 4)];
 };
 
+/* Bytes of file data an inode can hold itself: direct[] plus inline_tail. */
+#define INLINE_DATA_MAX (DIRECT_POINTERS * 4 + 4 + DIR_BLOOM_BYTES)
+
 struct dirent {
     uint32_t inode;
     char name[NAME_LEN];
 };
 
+/*
+ * Hashed directory index (extendible hashing). The root block maps the
+ * low `depth` bits of a name hash to a leaf block; each leaf holds
+ * (hash, dirent slot) pairs for the hashes sharing its low `depth` bits.
+ * A full leaf is split in two, doubling the root table when the leaf is
+ * already at the root's depth, so an insert touches one leaf in the
+ * common case and at most two leaves and the root on a split.
+ */
+struct dx_root {
+    uint32_t magic;
+    uint32_t depth;
+    uint32_t leaves[];
+};
+
+struct dx_entry {
+    uint32_t hash;
+    uint32_t slot;
+};
+
+struct dx_leaf {
+    uint32_t magic;
+    uint32_t depth;
+    uint32_t count;
+    uint32_t reserved;
+    struct dx_entry entries[];
+};
+
 struct journal_header {
     uint32_t magic;
     uint32_t nbytes_used;
 };
 
+/* size is 32 bits so a data record can carry a 64 KiB block. */
 struct rec_header {
     uint16_t type;
-    uint16_t size;
+    uint16_t unused;
+    uint32_t size;
 };
 
 struct data_record {
     struct rec_header hdr;
     uint32_t block_no;
-    uint8_t data[BLOCK_SIZE];
+    uint8_t data[];
 };
 
+/* Commit records written before the cursors existed end after hdr. */
 struct commit_record {
     struct rec_header hdr;
+    uint32_t next_inode;
+    uint32_t next_block;
+    uint32_t next_block_hi;
+};
+
+/* Blocks whose logged copies, in this or earlier transactions, must not be replayed. */
+struct revoke_record {
+    struct rec_header hdr;
+    uint32_t count;
+    uint32_t blocks[];
 };
 
+static uint32_t block_size = 4096U;
+
 static void die(const char *msg) {
     perror(msg);
     exit(EXIT_FAILURE);
 }
 
-static void read_block(int fd, uint32_t block_index, void *buf) {
+static uint64_t u64_join(uint32_t lo, uint32_t hi) {
+    return (uint64_t)hi << 32 | lo;
+}
+
+static uint32_t blocks_for_bits(uint64_t bits) {
+    return (uint32_t)((bits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK);
+}
+
+/*
+ * The layout must be exactly what mkfs writes: regions in order with no
+ * gaps, bitmaps sized for their counts, and everything inside the image.
+ * Every later read trusts these fields, so a mismatch rejects the image.
+ */
+static int check_geometry(const struct superblock *sb, off_t image_size) {
+    uint64_t total_blocks = u64_join(sb->total_blocks, sb->total_blocks_hi);
+    uint64_t data_blocks = u64_join(sb->data_blocks, sb->data_blocks_hi);
+    uint32_t inode_blocks = sb->inode_count / INODES_PER_BLOCK;
+    const char *bad = NULL;
+
+    if (!(sb->features & FEATURE_64BIT) && (sb->total_blocks_hi | sb->data_blocks_hi) != 0) {
+        bad = "64-bit block counts without the 64bit feature";
+    } else if (sb->journal_blocks == 0 || (uint64_t)sb->journal_blocks * BLOCK_SIZE > UINT32_MAX) {
+        bad = "journal size out of range";
+    } else if (sb->inode_count == 0 || sb->inode_count % INODES_PER_BLOCK != 0) {
+        bad = "inode count is not a whole number of inode blocks";
+    } else if (data_blocks == 0) {
+        bad = "no data blocks";
+    } else if (sb->inode_bitmap_blocks != blocks_for_bits(sb->inode_count) ||
+               sb->data_bitmap_blocks != blocks_for_bits(data_blocks)) {
+        bad = "bitmap sizes do not match the inode and data block counts";
+    } else if (sb->blocks_per_group == 0 || sb->blocks_per_group > BITS_PER_BLOCK ||
+               sb->group_count != (data_blocks + sb->blocks_per_group - 1) / sb->blocks_per_group ||
+               sb->inodes_per_group == 0 || sb->inodes_per_group > BITS_PER_BLOCK ||
+               sb->inodes_per_group % INODES_PER_BLOCK != 0 ||
+               (uint64_t)sb->inodes_per_group * sb->group_count != sb->inode_count ||
+               (uint64_t)sb->group_desc_blocks * GROUP_DESCS_PER_BLOCK < sb->group_count) {
+        bad = "block group geometry does not match the counts";
+    } else if (sb->journal_block != JOURNAL_BLOCK_IDX ||
+               (uint64_t)sb->inode_bitmap != (uint64_t)sb->journal_block + sb->journal_blocks ||
+               (uint64_t)sb->data_bitmap != (uint64_t)sb->inode_bitmap + sb->inode_bitmap_blocks ||
+               (uint64_t)sb->group_desc != (uint64_t)sb->data_bitmap + sb->data_bitmap_blocks ||
+               (uint64_t)sb->inode_start != (uint64_t)sb->group_desc + sb->group_desc_blocks ||
+               (uint64_t)sb->data_start != (uint64_t)sb->inode_start + inode_blocks ||
+               total_blocks != sb->data_start + data_blocks) {
+        bad = "regions are not contiguous";
+    } else if (total_blocks > ((sb->features & FEATURE_64BIT) ? MAX_64BIT_BLOCKS : UINT32_MAX)) {
+        bad = "total blocks exceed the addressing mode";
+    } else if ((uint64_t)image_size / BLOCK_SIZE < total_blocks) {
+        bad = "image is smaller than the filesystem";
+    }
+    if (bad) {
+        fprintf(stderr, "Error: corrupt superblock: %s\n", bad);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Reads the superblock, which always starts at byte 0, and adopts its
+ * block size. Returns -1 after printing an error if the image is not a
+ * VSFS filesystem or its layout does not hold together.
+ */
+static int read_superblock(int fd, struct superblock *sb) {
+    if (pread(fd, sb, sizeof(*sb), 0) != (ssize_t)sizeof(*sb) || sb->magic != FS_MAGIC) {
+        fprintf(stderr, "Error: invalid filesystem magic\n");
+        return -1;
+    }
+    if (sb->block_size < MIN_BLOCK_SIZE || sb->block_size > MAX_BLOCK_SIZE ||
+        (sb->block_size & (sb->block_size - 1)) != 0) {
+        fprintf(stderr, "Error: unsupported block size %u\n", sb->block_size);
+        return -1;
+    }
+    if (sb->features & ~FEATURE_KNOWN) {
+        fprintf(stderr, "Error: unsupported filesystem features 0x%x\n", sb->features);
+        return -1;
+    }
+    block_size = sb->block_size;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        die("fstat");
+    }
+    return check_geometry(sb, st.st_size);
+}
+
+static void read_block(int fd, uint64_t block_index, void *buf) {
     off_t offset = (off_t)block_index * BLOCK_SIZE;
     lseek(fd, offset, SEEK_SET);
     read(fd, buf, BLOCK_SIZE);
 }
 
-static void write_block(int fd, uint32_t block_index, const void *buf) {
+static void write_block(int fd, uint64_t block_index, const void *buf) {
     off_t offset = (off_t)block_index * BLOCK_SIZE;
     lseek(fd, offset, SEEK_SET);
     write(fd, buf, BLOCK_SIZE);
 }
 
-static int bitmap_test(const uint8_t *bitmap, uint32_t index) {
+/* File data goes straight to its home blocks, one pwrite per physical run. */
+static void write_data_blocks(int fd, uint64_t first_block, const void *buf, uint32_t count) {
+    off_t offset = (off_t)first_block * BLOCK_SIZE;
+    size_t len = (size_t)count * BLOCK_SIZE;
+    ssize_t n = pwrite(fd, buf, len, offset);
+    if (n != (ssize_t)len) {
+        die("pwrite data");
+    }
+}
+
+static int bitmap_test(const uint8_t *bitmap, uint64_t index) {
     return (bitmap[index / 8] >> (index % 8)) & 0x1;
 }
 
-static void bitmap_set(uint8_t *bitmap, uint32_t index) {
+static void bitmap_set(uint8_t *bitmap, uint64_t index) {
     bitmap[index / 8] |= (uint8_t)(1U << (index % 8));
 }
 
-static uint32_t bitmap_find_free(const uint8_t *bitmap, uint32_t max_bits) {
-    for (uint32_t i = 0; i < max_bits; i++) {
-        if (!bitmap_test(bitmap, i)) {
-            return i;
+static uint64_t bitmap_load_word(const uint8_t *bitmap, uint64_t word) {
+    uint64_t w;
+    memcpy(&w, bitmap + (size_t)word * 8, sizeof(w));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+
+/* Free bits of one word, with bits at or beyond max_bits reported as used. */
+static uint64_t bitmap_free_word(const uint8_t *bitmap, uint64_t word, uint64_t max_bits) {
+    uint64_t free_bits = ~bitmap_load_word(bitmap, word);
+    uint64_t base = word * 64;
+    if (max_bits - base < 64) {
+        free_bits &= (1ULL << (max_bits - base)) - 1;
+    }
+    return free_bits;
+}
+
+/* Free bits in [first, end). */
+static uint32_t bitmap_count_free(const uint8_t *bitmap, uint64_t first, uint64_t end) {
+    uint32_t count = 0;
+    for (uint64_t w = first / 64; w * 64 < end; w++) {
+        uint64_t free_bits = bitmap_free_word(bitmap, w, end);
+        if (w == first / 64) {
+            free_bits &= ~0ULL << (first % 64);
         }
+        count += (uint32_t)__builtin_popcountll(free_bits);
+    }
+    return count;
+}
+
+static uint64_t bitmap_find_free_words(const uint8_t *bitmap, uint64_t start, uint64_t max_bits) {
+    uint64_t nwords = (max_bits + 63) / 64;
+    for (uint64_t w = start / 64; w < nwords; w++) {
+        uint64_t free_bits = bitmap_free_word(bitmap, w, max_bits);
+        if (w == start / 64) {
+            free_bits &= ~0ULL << (start % 64);
+        }
+        if (free_bits) {
+            return w * 64 + (uint32_t)__builtin_ctzll(free_bits);
+        }
+    }
+    return (uint64_t)-1;
+}
+
+static int cpu_has_avx2(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) {
+        __builtin_cpu_init();
+        has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return has_avx2;
+#else
+    return 0;
+#endif
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Skips 256-bit chunks that are entirely allocated, then finishes in the word scan. */
+__attribute__((target("avx2")))
+static uint64_t bitmap_find_free_avx2(const uint8_t *bitmap, uint64_t start, uint64_t max_bits) {
+    const __m256i ones = _mm256_set1_epi32(-1);
+    uint64_t full_chunks = max_bits / 256;
+    uint64_t chunk = (start + 255) / 256;
+    if (start % 256 != 0) {
+        uint64_t head_end = chunk * 256 < max_bits ? chunk * 256 : max_bits;
+        uint64_t found = bitmap_find_free_words(bitmap, start, head_end);
+        if (found != (uint64_t)-1 || head_end == max_bits) {
+            return found;
+        }
+    }
+    while (chunk < full_chunks) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bitmap + (size_t)chunk * 32));
+        if (!_mm256_testc_si256(v, ones)) {
+            break;
+        }
+        chunk++;
+    }
+    return bitmap_find_free_words(bitmap, chunk * 256, max_bits);
+}
+#endif
+
+/* Returns the first free bit in [start, max_bits), or -1. */
+static uint64_t bitmap_find_free(const uint8_t *bitmap, uint64_t start, uint64_t max_bits) {
+    if (start >= max_bits) {
+        return (uint64_t)-1;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpu_has_avx2()) {
+        return bitmap_find_free_avx2(bitmap, start, max_bits);
+    }
+#endif
+    return bitmap_find_free_words(bitmap, start, max_bits);
+}
+
+static void bitmap_clear(uint8_t *bitmap, uint64_t index) {
+    bitmap[index / 8] &= (uint8_t)~(1U << (index % 8));
+}
+
+/*
+ * Next-fit allocator over one bitmap (inodes or data blocks). Bitmap and
+ * descriptor blocks are read on demand through the block cache of struct
+ * fs, so opening a large image does not load its whole bitmap. The
+ * descriptors' free counts act as the summary level: a group with none
+ * free is skipped without reading its bitmap block, and within a group
+ * the free-bit scan runs over the cached bitmap block. Setting or
+ * clearing a bit keeps its group's count in step. The cursor lets
+ * allocation resume where the previous one stopped; it exists only in
+ * memory and starts at bit 0 when the image is opened.
+ */
+struct fs;
+static uint8_t *fs_cache_block(struct fs *fs, uint32_t block_no);
+
+struct bitmap_alloc {
+    struct fs *fs;
+    uint32_t bitmap;
+    uint32_t group_desc;
+    int inodes;
+    uint64_t nbits;
+    uint64_t per_group;
+    uint64_t next;
+};
+
+static void bitmap_alloc_init(struct bitmap_alloc *alloc, struct fs *fs, const struct superblock *sb, int inodes) {
+    alloc->fs = fs;
+    alloc->bitmap = inodes ? sb->inode_bitmap : sb->data_bitmap;
+    alloc->group_desc = sb->group_desc;
+    alloc->inodes = inodes;
+    alloc->nbits = inodes ? sb->inode_count : u64_join(sb->data_blocks, sb->data_blocks_hi);
+    alloc->per_group = inodes ? sb->inodes_per_group : sb->blocks_per_group;
+    alloc->next = inodes ? sb->next_inode : u64_join(sb->next_block, sb->next_block_hi);
+    if (alloc->next >= alloc->nbits) {
+        alloc->next = 0;
+    }
+}
+
+/* The cached bitmap block holding bit; *base is the first bit it covers. */
+static uint8_t *bitmap_alloc_block(const struct bitmap_alloc *alloc, uint64_t bit, uint64_t *base) {
+    *base = bit / BITS_PER_BLOCK * BITS_PER_BLOCK;
+    return fs_cache_block(alloc->fs, alloc->bitmap + (uint32_t)(bit / BITS_PER_BLOCK));
+}
+
+/* Free count of group g in its cached descriptor. */
+static uint32_t *bitmap_alloc_group_free(const struct bitmap_alloc *alloc, uint64_t g) {
+    uint8_t *block = fs_cache_block(alloc->fs, alloc->group_desc + (uint32_t)(g / GROUP_DESCS_PER_BLOCK));
+    struct group_desc *gd = (struct group_desc *)block + g % GROUP_DESCS_PER_BLOCK;
+    return alloc->inodes ? &gd->free_inodes : &gd->free_blocks;
+}
+
+static int bitmap_alloc_test(const struct bitmap_alloc *alloc, uint64_t bit) {
+    uint64_t base;
+    const uint8_t *block = bitmap_alloc_block(alloc, bit, &base);
+    return bitmap_test(block, bit - base);
+}
+
+static void bitmap_alloc_set(struct bitmap_alloc *alloc, uint64_t bit) {
+    uint64_t base;
+    uint8_t *block = bitmap_alloc_block(alloc, bit, &base);
+    bitmap_set(block, bit - base);
+    (*bitmap_alloc_group_free(alloc, bit / alloc->per_group))--;
+}
+
+/* Returns 1 if the bit was set and is now free. */
+static int bitmap_alloc_clear(struct bitmap_alloc *alloc, uint64_t bit) {
+    uint64_t base;
+    uint8_t *block = bitmap_alloc_block(alloc, bit, &base);
+    if (!bitmap_test(block, bit - base)) {
+        return 0;
+    }
+    bitmap_clear(block, bit - base);
+    (*bitmap_alloc_group_free(alloc, bit / alloc->per_group))++;
+    return 1;
+}
+
+/* Free bits in [first, end), reading only the bitmap blocks the range covers. */
+static uint32_t bitmap_alloc_count(const struct bitmap_alloc *alloc, uint64_t first, uint64_t end) {
+    uint32_t count = 0;
+    while (first < end) {
+        uint64_t base;
+        const uint8_t *block = bitmap_alloc_block(alloc, first, &base);
+        uint64_t block_end = end - base < BITS_PER_BLOCK ? end - base : BITS_PER_BLOCK;
+        count += bitmap_count_free(block, first - base, block_end);
+        first = base + block_end;
+    }
+    return count;
+}
+
+/* First free bit in [start, end) of one group, or -1. */
+static uint64_t bitmap_alloc_scan(const struct bitmap_alloc *alloc, uint64_t start, uint64_t end) {
+    while (start < end) {
+        uint64_t base;
+        const uint8_t *block = bitmap_alloc_block(alloc, start, &base);
+        uint64_t block_end = end - base < BITS_PER_BLOCK ? end - base : BITS_PER_BLOCK;
+        uint64_t bit = bitmap_find_free(block, start - base, block_end);
+        if (bit != (uint64_t)-1) {
+            return base + bit;
+        }
+        start = base + block_end;
+    }
+    return (uint64_t)-1;
+}
+
+/* First free bit in [start, end), skipping groups whose descriptor has none free. */
+static uint64_t bitmap_alloc_find(const struct bitmap_alloc *alloc, uint64_t start, uint64_t end) {
+    while (start < end) {
+        uint64_t g = start / alloc->per_group;
+        uint64_t group_end = end - g * alloc->per_group > alloc->per_group ? (g + 1) * alloc->per_group : end;
+        if (*bitmap_alloc_group_free(alloc, g) > 0) {
+            uint64_t bit = bitmap_alloc_scan(alloc, start, group_end);
+            if (bit != (uint64_t)-1) {
+                return bit;
+            }
+        }
+        start = group_end;
+    }
+    return (uint64_t)-1;
+}
+
+/*
+ * Allocates one bit below limit, searching from goal to the end of
+ * goal's group, then the rest of that group, then the following groups,
+ * wrapping around.
+ */
+static uint64_t bitmap_alloc_bit(struct bitmap_alloc *alloc, uint64_t goal, uint64_t limit) {
+    if (limit > alloc->nbits) {
+        limit = alloc->nbits;
+    }
+    if (goal >= limit) {
+        goal = 0;
+    }
+    uint64_t group_start = goal / alloc->per_group * alloc->per_group;
+    uint64_t group_end = limit - group_start > alloc->per_group ? group_start + alloc->per_group : limit;
+    uint64_t bit = bitmap_alloc_find(alloc, goal, group_end);
+    if (bit == (uint64_t)-1) {
+        bit = bitmap_alloc_find(alloc, group_start, goal);
+    }
+    if (bit == (uint64_t)-1) {
+        bit = bitmap_alloc_find(alloc, group_end, limit);
+    }
+    if (bit == (uint64_t)-1) {
+        bit = bitmap_alloc_find(alloc, 0, group_start);
+    }
+    if (bit == (uint64_t)-1) {
+        return (uint64_t)-1;
+    }
+    bitmap_alloc_set(alloc, bit);
+    alloc->next = (bit + 1 < alloc->nbits) ? bit + 1 : 0;
+    return bit;
+}
+
+/* Returns the first bit of a run of count consecutive free bits in [start, max_bits), or -1. */
+static uint64_t bitmap_find_run(const uint8_t *bitmap, uint64_t start, uint64_t max_bits, uint32_t count) {
+    uint64_t nwords = (max_bits + 63) / 64;
+    uint64_t run_start = 0;
+    uint32_t run_len = 0;
+
+    if (count == 0 || start >= max_bits) {
+        return (uint64_t)-1;
+    }
+    for (uint64_t w = start / 64; w < nwords; w++) {
+        uint64_t free_bits = bitmap_free_word(bitmap, w, max_bits);
+        if (w == start / 64) {
+            free_bits &= ~0ULL << (start % 64);
+        }
+        if (free_bits == ~0ULL) {
+            if (run_len == 0) {
+                run_start = w * 64;
+            }
+            run_len += 64;
+            if (run_len >= count) {
+                return run_start;
+            }
+            continue;
+        }
+        uint32_t bit = 0;
+        while (bit < 64) {
+            uint64_t rest = free_bits >> bit;
+            if (rest == 0) {
+                run_len = 0;
+                break;
+            }
+            uint32_t used = (uint32_t)__builtin_ctzll(rest);
+            if (used > 0) {
+                run_len = 0;
+                bit += used;
+                rest >>= used;
+            }
+            uint32_t len = (uint32_t)__builtin_ctzll(~rest);
+            if (run_len == 0) {
+                run_start = w * 64 + bit;
+            }
+            run_len += len;
+            if (run_len >= count) {
+                return run_start;
+            }
+            bit += len;
+        }
+    }
+    return (uint64_t)-1;
+}
+
+/*
+ * First bit of a run of count free bits starting in a group from
+ * start's group up to the one holding end - 1, or -1. Groups with fewer
+ * than count free bits are skipped, and a run does not cross a bitmap
+ * block.
+ */
+static uint64_t bitmap_alloc_find_run(const struct bitmap_alloc *alloc, uint64_t start, uint64_t end,
+                                      uint32_t count) {
+    while (start < end) {
+        uint64_t g = start / alloc->per_group;
+        uint64_t group_end = alloc->nbits - g * alloc->per_group > alloc->per_group
+                                 ? (g + 1) * alloc->per_group : alloc->nbits;
+        if (*bitmap_alloc_group_free(alloc, g) >= count) {
+            uint64_t from = start;
+            while (from < group_end) {
+                uint64_t base;
+                const uint8_t *block = bitmap_alloc_block(alloc, from, &base);
+                uint64_t block_end = group_end - base < BITS_PER_BLOCK ? group_end - base : BITS_PER_BLOCK;
+                uint64_t bit = bitmap_find_run(block, from - base, block_end, count);
+                if (bit != (uint64_t)-1) {
+                    return base + bit;
+                }
+                from = base + block_end;
+            }
+        }
+        start = group_end;
+    }
+    return (uint64_t)-1;
+}
+
+/*
+ * Allocates up to count consecutive bits, preferring the longest run (up
+ * to count) at or after goal. Returns the first bit and stores the run
+ * length in *len, or -1 when nothing is free.
+ */
+static uint64_t bitmap_alloc_run(struct bitmap_alloc *alloc, uint64_t goal, uint32_t count, uint32_t *len) {
+    if (count == 0) {
+        return (uint64_t)-1;
+    }
+    uint64_t hint = goal < alloc->nbits ? goal : 0;
+    for (uint32_t want = count; want > 0; want /= 2) {
+        uint64_t bit = bitmap_alloc_find_run(alloc, hint, alloc->nbits, want);
+        if (bit == (uint64_t)-1 && hint > 0) {
+            bit = bitmap_alloc_find_run(alloc, 0, hint, want);
+        }
+        if (bit == (uint64_t)-1) {
+            continue;
+        }
+        uint32_t n = want;
+        while (n < count && bit + n < alloc->nbits && !bitmap_alloc_test(alloc, bit + n)) {
+            n++;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            bitmap_alloc_set(alloc, bit + i);
+        }
+        alloc->next = (bit + n < alloc->nbits) ? bit + n : 0;
+        *len = n;
+        return bit;
+    }
+    return (uint64_t)-1;
+}
+
+static uint32_t journal_size(const struct superblock *sb) {
+    return sb->journal_blocks * BLOCK_SIZE;
+}
+
+static int journal_is_initialized(const uint8_t *journal_buf);
+
+/* Reads the journal header block and then only the blocks holding records. */
+static void read_journal(int fd, const struct superblock *sb, uint8_t *journal_buf) {
+    read_block(fd, sb->journal_block, journal_buf);
+    if (!journal_is_initialized(journal_buf)) {
+        return;
+    }
+    const struct journal_header *jhdr = (const struct journal_header *)journal_buf;
+    uint32_t used = jhdr->nbytes_used < journal_size(sb) ? jhdr->nbytes_used : journal_size(sb);
+    for (uint32_t i = 1; i < (used + BLOCK_SIZE - 1) / BLOCK_SIZE; i++) {
+        read_block(fd, sb->journal_block + i, journal_buf + (i * BLOCK_SIZE));
     }
-    return (uint32_t)-1;
 }
 
-static void read_journal(int fd, uint8_t *journal_buf) {
-    for (uint32_t i = 0; i < JOURNAL_BLOCKS; i++) {
-        read_block(fd, JOURNAL_BLOCK_IDX + i, journal_buf + (i * BLOCK_SIZE));
+/* Writes the header block and the blocks holding bytes [from, nbytes_used). */
+static void write_journal(int fd, const struct superblock *sb, const uint8_t *journal_buf, uint32_t from) {
+    const struct journal_header *jhdr = (const struct journal_header *)journal_buf;
+    write_block(fd, sb->journal_block, journal_buf);
+    uint32_t first = from / BLOCK_SIZE > 1 ? from / BLOCK_SIZE : 1;
+    for (uint32_t i = first; i < (jhdr->nbytes_used + BLOCK_SIZE - 1) / BLOCK_SIZE; i++) {
+        write_block(fd, sb->journal_block + i, journal_buf + (i * BLOCK_SIZE));
     }
 }
 
-static void write_journal(int fd, const uint8_t *journal_buf) {
-    for (uint32_t i = 0; i < JOURNAL_BLOCKS; i++) {
-        write_block(fd, JOURNAL_BLOCK_IDX + i, journal_buf + (i * BLOCK_SIZE));
+/*
+ * Deallocates blocks [first, first + count) in the image file; they read
+ * back as zeros. A failure only costs space, so it is reported once and
+ * otherwise ignored.
+ */
+static void punch_blocks(int fd, uint64_t first, uint64_t count) {
+    static int warned;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)(first * BLOCK_SIZE),
+                  (off_t)(count * BLOCK_SIZE)) < 0 && !warned) {
+        fprintf(stderr, "Warning: cannot punch holes in the image: %s\n", strerror(errno));
+        warned = 1;
     }
 }
 
 static void init_journal(uint8_t *journal_buf) {
-    memset(journal_buf, 0, JOURNAL_SIZE);
+    memset(journal_buf, 0, BLOCK_SIZE);
     struct journal_header *jhdr = (struct journal_header *)journal_buf;
     jhdr->magic = JOURNAL_MAGIC;
     jhdr->nbytes_used = sizeof(struct journal_header);
@@ -154,10 +812,23 @@ static void append_data_record(uint8_t *journal_buf, uint32_t *offset,
     *offset += rec->hdr.size;
 }
 
-static void append_commit_record(uint8_t *journal_buf, uint32_t *offset) {
+static void append_commit_record(uint8_t *journal_buf, uint32_t *offset, uint32_t next_inode, uint64_t next_block) {
     struct commit_record *rec = (struct commit_record *)(journal_buf + *offset);
     rec->hdr.type = REC_COMMIT;
-    rec->hdr.size = sizeof(struct rec_header);
+    rec->hdr.size = sizeof(struct commit_record);
+    rec->next_inode = next_inode;
+    rec->next_block = (uint32_t)next_block;
+    rec->next_block_hi = (uint32_t)(next_block >> 32);
+    *offset += rec->hdr.size;
+}
+
+static void append_revoke_record(uint8_t *journal_buf, uint32_t *offset,
+                                 const uint32_t *blocks, uint32_t count) {
+    struct revoke_record *rec = (struct revoke_record *)(journal_buf + *offset);
+    rec->hdr.type = REC_REVOKE;
+    rec->hdr.size = sizeof(struct revoke_record) + count * sizeof(uint32_t);
+    rec->count = count;
+    memcpy(rec->blocks, blocks, count * sizeof(uint32_t));
     *offset += rec->hdr.size;
 }
 
@@ -166,214 +837,2471 @@ static void update_journal_header(uint8_t *journal_buf, uint32_t nbytes_used) {
     jhdr->nbytes_used = nbytes_used;
 }
 
-static void cmd_create(const char *image_path, const char *filename) {
-    if (strlen(filename) >= NAME_LEN) {
-        fprintf(stderr, "Error: filename too long (max %d chars)\n", NAME_LEN - 1);
-        exit(EXIT_FAILURE);
-    }
+/*
+ * Map from block number to a 32-bit value. Open addressing, keys stored
+ * as block+1 so zero marks an empty slot.
+ */
+struct block_map {
+    uint32_t *keys;
+    uint32_t *values;
+    uint32_t capacity;
+    uint32_t count;
+};
 
-    int fd = open(image_path, O_RDWR);
-    if (fd < 0) {
-        die("open");
+static uint32_t block_map_probe(const struct block_map *map, uint32_t block_no) {
+    uint32_t mask = map->capacity - 1;
+    uint32_t i = (block_no * 2654435761U) & mask;
+    while (map->keys[i] != 0 && map->keys[i] != block_no + 1) {
+        i = (i + 1) & mask;
     }
+    return i;
+}
 
-    struct superblock sb;
-    read_block(fd, 0, &sb);
+/* Returns 1 and stores the value in *value if block_no is in the map. */
+static int block_map_get(const struct block_map *map, uint32_t block_no, uint32_t *value) {
+    if (map->capacity == 0) {
+        return 0;
+    }
+    uint32_t slot = block_map_probe(map, block_no);
+    if (map->keys[slot] == 0) {
+        return 0;
+    }
+    *value = map->values[slot];
+    return 1;
+}
 
-    if (sb.magic != FS_MAGIC) {
-        fprintf(stderr, "Error: invalid filesystem magic\n");
-        close(fd);
-        exit(EXIT_FAILURE);
+static void block_map_set(struct block_map *map, uint32_t block_no, uint32_t value) {
+    if ((map->count + 1) * 2 > map->capacity) {
+        struct block_map grown = {0};
+        grown.capacity = map->capacity ? map->capacity * 2 : 64;
+        grown.keys = calloc(grown.capacity, sizeof(uint32_t));
+        grown.values = calloc(grown.capacity, sizeof(uint32_t));
+        if (!grown.keys || !grown.values) {
+            die("calloc block map");
+        }
+        for (uint32_t i = 0; i < map->capacity; i++) {
+            if (map->keys[i] != 0) {
+                uint32_t slot = block_map_probe(&grown, map->keys[i] - 1);
+                grown.keys[slot] = map->keys[i];
+                grown.values[slot] = map->values[i];
+                grown.count++;
+            }
+        }
+        free(map->keys);
+        free(map->values);
+        *map = grown;
     }
 
-    uint8_t *journal_buf = malloc(JOURNAL_SIZE);
-    if (!journal_buf) {
-        die("malloc journal");
+    uint32_t slot = block_map_probe(map, block_no);
+    if (map->keys[slot] == 0) {
+        map->keys[slot] = block_no + 1;
+        map->count++;
     }
-    read_journal(fd, journal_buf);
+    map->values[slot] = value;
+}
 
-    if (!journal_is_initialized(journal_buf)) {
-        init_journal(journal_buf);
+static void block_map_clear(struct block_map *map) {
+    if (map->capacity > 0) {
+        memset(map->keys, 0, map->capacity * sizeof(uint32_t));
     }
+    map->count = 0;
+}
 
-    struct journal_header *jhdr = (struct journal_header *)journal_buf;
-    uint32_t current_offset = jhdr->nbytes_used;
-
-    uint8_t inode_bitmap[BLOCK_SIZE];
-    uint8_t data_bitmap[BLOCK_SIZE];
-    uint8_t inode_block[BLOCK_SIZE];
-    uint8_t root_data_block[BLOCK_SIZE];
-
-    read_block(fd, INODE_BMAP_IDX, inode_bitmap);
-    read_block(fd, DATA_BMAP_IDX, data_bitmap);
-    read_block(fd, INODE_START_IDX, inode_block);
-    
-    struct inode *root_inode = (struct inode *)inode_block;
-    uint32_t root_data_blk = root_inode->direct[0];
-    read_block(fd, root_data_blk, root_data_block);
-
-    uint32_t free_inode = bitmap_find_free(inode_bitmap, sb.inode_count);
-    if (free_inode == (uint32_t)-1) {
-        fprintf(stderr, "Error: no free inodes\n");
-        free(journal_buf);
-        close(fd);
-        exit(EXIT_FAILURE);
+static void block_map_free(struct block_map *map) {
+    free(map->keys);
+    free(map->values);
+    memset(map, 0, sizeof(*map));
+}
+
+/*
+ * Size of the record at offset, or 0 where the log ends: past end, an
+ * unknown type, a size below the type's minimum or running past end.
+ * Scans stop at a 0, so a damaged size can neither loop nor overrun.
+ */
+static uint32_t journal_record_size(const uint8_t *journal_buf, uint32_t offset, uint32_t end) {
+    if (offset > end || end - offset < sizeof(struct rec_header)) {
+        return 0;
+    }
+    const struct rec_header *hdr = (const struct rec_header *)(journal_buf + offset);
+    uint32_t min_size;
+    if (hdr->type == REC_DATA) {
+        min_size = sizeof(struct data_record) + BLOCK_SIZE;
+    } else if (hdr->type == REC_REVOKE) {
+        min_size = sizeof(struct revoke_record);
+    } else if (hdr->type == REC_COMMIT) {
+        min_size = sizeof(struct rec_header);
+    } else {
+        return 0;
     }
+    if (hdr->size < min_size || hdr->size > end - offset) {
+        return 0;
+    }
+    if (hdr->type == REC_REVOKE &&
+        ((const struct revoke_record *)hdr)->count > (hdr->size - min_size) / sizeof(uint32_t)) {
+        return 0;
+    }
+    return hdr->size;
+}
 
-    struct dirent *entries = (struct dirent *)root_data_block;
-    uint32_t max_entries = BLOCK_SIZE / sizeof(struct dirent);
-    uint32_t free_entry = (uint32_t)-1;
-    
-    for (uint32_t i = 0; i < max_entries; i++) {
-        if (entries[i].inode == 0 && entries[i].name[0] == '\0') {
-            free_entry = i;
-            break;
+/* End of the last commit record in journal bytes [from, end); from if there is none. */
+static uint32_t journal_committed_end(const uint8_t *journal_buf, uint32_t from, uint32_t end) {
+    uint32_t committed = from;
+    uint32_t offset = from;
+    uint32_t size;
+    while ((size = journal_record_size(journal_buf, offset, end)) != 0) {
+        offset += size;
+        if (((const struct rec_header *)(journal_buf + offset - size))->type == REC_COMMIT) {
+            committed = offset;
         }
-        if (strcmp(entries[i].name, filename) == 0) {
-            fprintf(stderr, "Error: file '%s' already exists\n", filename);
-            free(journal_buf);
-            close(fd);
-            exit(EXIT_FAILURE);
+    }
+    return committed;
+}
+
+/*
+ * Adds the committed transactions in journal bytes [from, end) to the
+ * journal index, which maps each block to the offset of its latest
+ * committed copy in journal_buf, or to 0 once a committed revoke hides
+ * it. Records of a transaction without a commit record are ignored.
+ */
+static void journal_index_add(struct block_map *index, const uint8_t *journal_buf, uint32_t from, uint32_t end) {
+    uint32_t txn_start = from;
+    uint32_t offset = from;
+    uint32_t size;
+    while ((size = journal_record_size(journal_buf, offset, end)) != 0) {
+        const struct rec_header *hdr = (const struct rec_header *)(journal_buf + offset);
+        if (hdr->type == REC_COMMIT) {
+            /* Data first: a revoke in the same transaction wins wherever it was logged. */
+            for (uint32_t o = txn_start; o < offset; o += ((const struct rec_header *)(journal_buf + o))->size) {
+                const struct data_record *rec = (const struct data_record *)(journal_buf + o);
+                if (rec->hdr.type == REC_DATA) {
+                    block_map_set(index, rec->block_no, (uint32_t)(rec->data - journal_buf));
+                }
+            }
+            for (uint32_t o = txn_start; o < offset; o += ((const struct rec_header *)(journal_buf + o))->size) {
+                const struct revoke_record *rev = (const struct revoke_record *)(journal_buf + o);
+                for (uint32_t i = 0; rev->hdr.type == REC_REVOKE && i < rev->count; i++) {
+                    block_map_set(index, rev->blocks[i], 0);
+                }
+            }
+            txn_start = offset + size;
         }
+        offset += size;
     }
+}
 
-    if (free_entry == (uint32_t)-1) {
-        fprintf(stderr, "Error: root directory is full\n");
-        free(journal_buf);
-        close(fd);
-        exit(EXIT_FAILURE);
+/*
+ * Copies the cursors of the last committed transaction in journal bytes
+ * [from, end) into sb; 0 if no commit record there carries them.
+ */
+static int journal_cursors(const uint8_t *journal_buf, uint32_t from, uint32_t end, struct superblock *sb) {
+    int found = 0;
+    uint32_t offset = from;
+    uint32_t size;
+    while ((size = journal_record_size(journal_buf, offset, end)) != 0) {
+        const struct rec_header *hdr = (const struct rec_header *)(journal_buf + offset);
+        if (hdr->type == REC_COMMIT && size >= sizeof(struct commit_record)) {
+            const struct commit_record *rec = (const struct commit_record *)hdr;
+            sb->next_inode = rec->next_inode;
+            sb->next_block = rec->next_block;
+            sb->next_block_hi = rec->next_block_hi;
+            found = 1;
+        }
+        offset += size;
     }
+    return found;
+}
+
+/* Bits [*first, *end) of the inode or data bitmap that belong to group g. */
+static void group_bits(const struct superblock *sb, int inodes, uint32_t g, uint64_t *first, uint64_t *end) {
+    uint64_t per_group = inodes ? sb->inodes_per_group : sb->blocks_per_group;
+    uint64_t nbits = inodes ? sb->inode_count : u64_join(sb->data_blocks, sb->data_blocks_hi);
+    *first = g * per_group;
+    *end = nbits - *first < per_group ? nbits : *first + per_group;
+}
 
+/*
+ * Groups [*first, *end) with bits in block_no, or an empty range if
+ * block_no is not a bitmap block. *inodes tells which bitmap it is.
+ */
+static void bitmap_block_groups(const struct superblock *sb, uint32_t block_no, int *inodes,
+                                uint32_t *first, uint32_t *end) {
+    *first = *end = 0;
+    *inodes = block_no >= sb->inode_bitmap && block_no - sb->inode_bitmap < sb->inode_bitmap_blocks;
+    int data = block_no >= sb->data_bitmap && block_no - sb->data_bitmap < sb->data_bitmap_blocks;
+    if (!*inodes && !data) {
+        return;
+    }
+    uint64_t per_group = *inodes ? sb->inodes_per_group : sb->blocks_per_group;
+    uint64_t nbits = *inodes ? sb->inode_count : u64_join(sb->data_blocks, sb->data_blocks_hi);
+    uint64_t bit = (uint64_t)(block_no - (*inodes ? sb->inode_bitmap : sb->data_bitmap)) * BITS_PER_BLOCK;
+    uint64_t last = bit + BITS_PER_BLOCK < nbits ? bit + BITS_PER_BLOCK - 1 : nbits - 1;
+    *first = (uint32_t)(bit / per_group);
+    *end = (uint32_t)(last / per_group + 1);
+}
 
-    uint8_t new_inode_bitmap[BLOCK_SIZE];
-    uint8_t new_inode_block[BLOCK_SIZE];
-    uint8_t new_root_data_block[BLOCK_SIZE];
+/*
+ * Open image with its allocator state. Metadata is read through the
+ * journal so transactions that were committed but not yet installed are
+ * visible to the next command.
+ */
+struct fs {
+    int fd;
+    uint8_t *journal_buf;
+    uint8_t *sb_block;
+    struct superblock *sb;
+    struct bitmap_alloc inode_alloc;
+    struct bitmap_alloc data_alloc;
+
+    /* Latest committed copy of each block in the journal, built at open (see journal_index_add). */
+    struct block_map journal_index;
+
+    /*
+     * Bitmap and descriptor blocks read so far, as indexes into cache_blocks.
+     * Allocation changes them in place and txn_attach logs them; they stay
+     * cached until fs_close.
+     */
+    struct block_map cache;
+    uint8_t **cache_blocks;
+    uint32_t ncache_blocks;
+    uint32_t cache_blocks_capacity;
+
+    /* Data blocks freed by the open transaction, released when it commits. */
+    uint64_t *freed;
+    uint32_t nfreed;
+    uint32_t freed_capacity;
+
+    /* Inode-table groups first used by the open transaction, zeroed when it commits. */
+    uint32_t *zero_groups;
+    uint32_t nzero_groups;
+    uint32_t zero_groups_capacity;
+
+    /* Dentry and inode caches, only kept by long-running commands; NULL otherwise. */
+    struct dcache *dcache;
+    struct icache *icache;
+};
 
-    memcpy(new_inode_bitmap, inode_bitmap, BLOCK_SIZE);
-    memcpy(new_inode_block, inode_block, BLOCK_SIZE);
-    memcpy(new_root_data_block, root_data_block, BLOCK_SIZE);
+static void fs_read_block(const struct fs *fs, uint32_t block_index, void *buf) {
+    uint32_t offset;
+    if (block_map_get(&fs->journal_index, block_index, &offset) && offset != 0) {
+        memcpy(buf, fs->journal_buf + offset, BLOCK_SIZE);
+    } else {
+        read_block(fs->fd, block_index, buf);
+    }
+}
 
-    bitmap_set(new_inode_bitmap, free_inode);
+/* Whether block_no has a committed copy in the journal. */
+static int fs_journaled(const struct fs *fs, uint32_t block_no) {
+    uint32_t offset;
+    return block_map_get(&fs->journal_index, block_no, &offset) && offset != 0;
+}
 
-    uint32_t inode_block_idx = free_inode / (BLOCK_SIZE / INODE_SIZE);
-    uint32_t inode_offset = free_inode % (BLOCK_SIZE / INODE_SIZE);
-    
-    if (inode_block_idx != 0) {
-        read_block(fd, INODE_START_IDX + inode_block_idx, new_inode_block);
+static uint8_t *fs_cache_block(struct fs *fs, uint32_t block_no) {
+    uint32_t i;
+    if (block_map_get(&fs->cache, block_no, &i)) {
+        return fs->cache_blocks[i];
     }
-    
-    struct inode *new_file_inode = (struct inode *)(new_inode_block + inode_offset * INODE_SIZE);
-    new_file_inode->type = INODE_FILE;
-    new_file_inode->links = 1;
-    new_file_inode->size = 0;
-    memset(new_file_inode->direct, 0, sizeof(new_file_inode->direct));
-    time_t now = time(NULL);
-    new_file_inode->ctime = (uint32_t)now;
-    new_file_inode->mtime = (uint32_t)now;
+    if (fs->ncache_blocks == fs->cache_blocks_capacity) {
+        fs->cache_blocks_capacity = fs->cache_blocks_capacity ? fs->cache_blocks_capacity * 2 : 16;
+        fs->cache_blocks = realloc(fs->cache_blocks, fs->cache_blocks_capacity * sizeof(*fs->cache_blocks));
+        if (!fs->cache_blocks) {
+            die("realloc block cache");
+        }
+    }
+    uint8_t *block = malloc(BLOCK_SIZE);
+    if (!block) {
+        die("malloc block cache");
+    }
+    fs_read_block(fs, block_no, block);
+    fs->cache_blocks[fs->ncache_blocks] = block;
+    block_map_set(&fs->cache, block_no, fs->ncache_blocks++);
+    return block;
+}
 
-    struct dirent *new_entries = (struct dirent *)new_root_data_block;
-    new_entries[free_entry].inode = free_inode;
-    strncpy(new_entries[free_entry].name, filename, NAME_LEN - 1);
-    new_entries[free_entry].name[NAME_LEN - 1] = '\0';
+static struct group_desc *fs_group(struct fs *fs, uint32_t g) {
+    uint8_t *block = fs_cache_block(fs, fs->sb->group_desc + g / GROUP_DESCS_PER_BLOCK);
+    return (struct group_desc *)block + g % GROUP_DESCS_PER_BLOCK;
+}
 
-    struct inode *new_root_inode = (struct inode *)new_inode_block;
-    if (inode_block_idx == 0) {
-        new_root_inode->size += sizeof(struct dirent);
-        new_root_inode->mtime = (uint32_t)now;
+/*
+ * The home descriptors predate every bitmap block still in the journal,
+ * since their counts are never logged. Recounts the groups those blocks
+ * cover from the bitmaps as read through the journal.
+ */
+static void fs_recount_groups(struct fs *fs) {
+    const struct block_map *index = &fs->journal_index;
+    for (uint32_t i = 0; i < index->capacity; i++) {
+        if (index->keys[i] == 0 || index->values[i] == 0) {
+            continue;
+        }
+        int inodes;
+        uint32_t first, end;
+        bitmap_block_groups(fs->sb, index->keys[i] - 1, &inodes, &first, &end);
+        for (uint32_t g = first; g < end; g++) {
+            uint64_t lo, hi;
+            group_bits(fs->sb, inodes, g, &lo, &hi);
+            if (inodes) {
+                fs_group(fs, g)->free_inodes = bitmap_alloc_count(&fs->inode_alloc, lo, hi);
+            } else {
+                fs_group(fs, g)->free_blocks = bitmap_alloc_count(&fs->data_alloc, lo, hi);
+            }
+        }
     }
+}
 
-    uint32_t record_size = sizeof(struct rec_header) + sizeof(uint32_t) + BLOCK_SIZE;
-    uint32_t num_data_records = 3;
-    uint32_t commit_size = sizeof(struct rec_header);
-    uint32_t total_needed = (num_data_records * record_size) + commit_size;
+static void fs_open(struct fs *fs, const char *image_path) {
+    fs->fd = open(image_path, O_RDWR);
+    if (fs->fd < 0) {
+        die("open");
+    }
 
-    if (current_offset + total_needed > JOURNAL_SIZE) {
-        fprintf(stderr, "Error: insufficient journal space. Install journal!\n");
-        free(journal_buf);
-        close(fd);
+    /* The layout fields never change after mkfs, so the on-disk copy locates the journal. */
+    struct superblock disk_sb;
+    if (read_superblock(fs->fd, &disk_sb) < 0) {
+        close(fs->fd);
         exit(EXIT_FAILURE);
     }
+    fs->sb_block = malloc(BLOCK_SIZE);
+    if (!fs->sb_block) {
+        die("malloc superblock");
+    }
+    read_block(fs->fd, 0, fs->sb_block);
+    fs->sb = (struct superblock *)fs->sb_block;
 
-    append_data_record(journal_buf, &current_offset, INODE_BMAP_IDX, new_inode_bitmap);
-    append_data_record(journal_buf, &current_offset, INODE_START_IDX + inode_block_idx, new_inode_block);
-    append_data_record(journal_buf, &current_offset, root_data_blk, new_root_data_block);
+    fs->journal_buf = malloc(journal_size(fs->sb));
+    if (!fs->journal_buf) {
+        die("malloc journal");
+    }
+    read_journal(fs->fd, fs->sb, fs->journal_buf);
 
-    append_commit_record(journal_buf, &current_offset);
+    if (!journal_is_initialized(fs->journal_buf)) {
+        init_journal(fs->journal_buf);
+    }
+    memset(&fs->journal_index, 0, sizeof(fs->journal_index));
+    const struct journal_header *jhdr = (const struct journal_header *)fs->journal_buf;
+    uint32_t nbytes_used = jhdr->nbytes_used < journal_size(fs->sb) ? jhdr->nbytes_used : journal_size(fs->sb);
+    /* Records past the last commit never took effect; the next commit overwrites them. */
+    nbytes_used = journal_committed_end(fs->journal_buf, sizeof(struct journal_header), nbytes_used);
+    ((struct journal_header *)fs->journal_buf)->nbytes_used = nbytes_used;
+    journal_index_add(&fs->journal_index, fs->journal_buf, sizeof(struct journal_header), nbytes_used);
+    journal_cursors(fs->journal_buf, sizeof(struct journal_header), nbytes_used, fs->sb);
+
+    memset(&fs->cache, 0, sizeof(fs->cache));
+    fs->cache_blocks = NULL;
+    fs->ncache_blocks = 0;
+    fs->cache_blocks_capacity = 0;
+    bitmap_alloc_init(&fs->inode_alloc, fs, fs->sb, 1);
+    bitmap_alloc_init(&fs->data_alloc, fs, fs->sb, 0);
+    fs_recount_groups(fs);
+    fs->freed = NULL;
+    fs->nfreed = 0;
+    fs->freed_capacity = 0;
+    fs->zero_groups = NULL;
+    fs->nzero_groups = 0;
+    fs->zero_groups_capacity = 0;
+    fs->dcache = NULL;
+    fs->icache = NULL;
+}
 
-    update_journal_header(journal_buf, current_offset);
+static void fs_close(struct fs *fs) {
+    for (uint32_t i = 0; i < fs->ncache_blocks; i++) {
+        free(fs->cache_blocks[i]);
+    }
+    free(fs->cache_blocks);
+    block_map_free(&fs->cache);
+    block_map_free(&fs->journal_index);
+    free(fs->freed);
+    free(fs->zero_groups);
+    free(fs->journal_buf);
+    free(fs->sb_block);
+    close(fs->fd);
+}
 
-    write_journal(fd, journal_buf);
+/*
+ * Blocks read or modified by one command. Modified blocks are logged as
+ * a single transaction by txn_commit; blocks that were only read stay
+ * cached so repeated lookups do not go back to the image.
+ */
+struct txn_block {
+    uint32_t block_no;
+    int dirty;
+    int owned;
+    uint8_t *data;
+};
 
-    free(journal_buf);
-    close(fd);
+struct txn {
+    struct txn_block *blocks;
+    uint32_t count;
+    uint32_t capacity;
+};
 
-    printf("Created file '%s'\n", filename);
+static struct txn_block *txn_find(struct txn *txn, uint32_t block_no) {
+    for (uint32_t i = 0; i < txn->count; i++) {
+        if (txn->blocks[i].block_no == block_no) {
+            return &txn->blocks[i];
+        }
+    }
+    return NULL;
 }
 
-static void cmd_install(const char *image_path) {
-    int fd = open(image_path, O_RDWR);
-    if (fd < 0) {
-        die("open");
+static struct txn_block *txn_add(struct txn *txn, uint32_t block_no, uint8_t *data, int owned) {
+    if (txn->count == txn->capacity) {
+        uint32_t capacity = txn->capacity ? txn->capacity * 2 : 8;
+        struct txn_block *blocks = realloc(txn->blocks, capacity * sizeof(*blocks));
+        if (!blocks) {
+            die("realloc txn");
+        }
+        txn->blocks = blocks;
+        txn->capacity = capacity;
     }
+    struct txn_block *tb = &txn->blocks[txn->count++];
+    tb->block_no = block_no;
+    tb->dirty = 0;
+    tb->owned = owned;
+    tb->data = data;
+    return tb;
+}
 
-    uint8_t *journal_buf = malloc(JOURNAL_SIZE);
-    if (!journal_buf) {
-        die("malloc journal");
+/* Whether block_no is in an inode-table group the open transaction will zero. */
+static int fs_itable_pending(const struct fs *fs, uint32_t block_no) {
+    if (block_no < fs->sb->inode_start || block_no >= fs->sb->data_start) {
+        return 0;
     }
-    read_journal(fd, journal_buf);
-
-    if (!journal_is_initialized(journal_buf)) {
-        fprintf(stderr, "Error: journal does not exist or is not initialized\n");
-        free(journal_buf);
-        close(fd);
-        exit(EXIT_FAILURE);
+    uint32_t g = (block_no - fs->sb->inode_start) / (fs->sb->inodes_per_group / INODES_PER_BLOCK);
+    for (uint32_t i = 0; i < fs->nzero_groups; i++) {
+        if (fs->zero_groups[i] == g) {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    struct journal_header *jhdr = (struct journal_header *)journal_buf;
-    uint32_t offset = sizeof(struct journal_header);
-    uint32_t nbytes_used = jhdr->nbytes_used;
-
-    int transactions_replayed = 0;
+static struct txn_block *txn_load(struct fs *fs, struct txn *txn, uint32_t block_no) {
+    struct txn_block *tb = txn_find(txn, block_no);
+    if (tb) {
+        return tb;
+    }
+    uint8_t *data = malloc(BLOCK_SIZE);
+    if (!data) {
+        die("malloc block");
+    }
+    if (fs_itable_pending(fs, block_no)) {
+        memset(data, 0, BLOCK_SIZE);
+    } else {
+        fs_read_block(fs, block_no, data);
+    }
+    return txn_add(txn, block_no, data, 1);
+}
+
+static const uint8_t *txn_read(struct fs *fs, struct txn *txn, uint32_t block_no) {
+    return txn_load(fs, txn, block_no)->data;
+}
+
+static uint8_t *txn_write(struct fs *fs, struct txn *txn, uint32_t block_no) {
+    struct txn_block *tb = txn_load(fs, txn, block_no);
+    tb->dirty = 1;
+    return tb->data;
+}
+
+/* Zero-filled buffer for a block that was just allocated. */
+static uint8_t *txn_new(struct txn *txn, uint32_t block_no) {
+    struct txn_block *tb = txn_find(txn, block_no);
+    if (!tb) {
+        uint8_t *data = malloc(BLOCK_SIZE);
+        if (!data) {
+            die("malloc block");
+        }
+        tb = txn_add(txn, block_no, data, 1);
+    }
+    memset(tb->data, 0, BLOCK_SIZE);
+    tb->dirty = 1;
+    return tb->data;
+}
+
+/* Logs a buffer owned by struct fs (a bitmap or descriptor block) with this transaction. */
+static void txn_attach(struct txn *txn, uint32_t block_no, uint8_t *data) {
+    struct txn_block *tb = txn_find(txn, block_no);
+    if (!tb) {
+        tb = txn_add(txn, block_no, data, 0);
+    }
+    tb->dirty = 1;
+}
+
+static void txn_free(struct txn *txn) {
+    for (uint32_t i = 0; i < txn->count; i++) {
+        if (txn->blocks[i].owned) {
+            free(txn->blocks[i].data);
+        }
+    }
+    free(txn->blocks);
+    txn->blocks = NULL;
+    txn->count = 0;
+    txn->capacity = 0;
+}
+
+static int fs_is_freed(const struct fs *fs, uint64_t blk) {
+    for (uint32_t i = 0; i < fs->nfreed; i++) {
+        if (fs->freed[i] == blk) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Freed blocks that still have a committed copy in the journal. Without
+ * a revoke, install would copy that stale metadata over whatever the
+ * block holds after it is reallocated, possibly file data written
+ * outside the journal. Returns the count; blocks may be NULL. Blocks
+ * past 2^32 only ever hold file data, so they are never in the journal.
+ */
+static uint32_t fs_revokes(const struct fs *fs, uint32_t *blocks) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < fs->nfreed; i++) {
+        if (fs->freed[i] <= UINT32_MAX && fs_journaled(fs, (uint32_t)fs->freed[i])) {
+            if (blocks) {
+                blocks[count] = fs->freed[i];
+            }
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Dirty blocks are logged unless the transaction also frees them. */
+static int txn_logs(const struct fs *fs, const struct txn_block *tb) {
+    return tb->dirty && !fs_is_freed(fs, tb->block_no);
+}
+
+static int txn_fits(const struct fs *fs, const struct txn *txn) {
+    const struct journal_header *jhdr = (const struct journal_header *)fs->journal_buf;
+    uint32_t record_size = sizeof(struct rec_header) + sizeof(uint32_t) + BLOCK_SIZE;
+    uint32_t num_data_records = 0;
+    for (uint32_t i = 0; i < txn->count; i++) {
+        num_data_records += txn_logs(fs, &txn->blocks[i]);
+    }
+    uint32_t num_revokes = fs_revokes(fs, NULL);
+    uint32_t revoke_size = num_revokes ? sizeof(struct revoke_record) + num_revokes * sizeof(uint32_t) : 0;
+    uint32_t commit_size = sizeof(struct commit_record);
+    uint32_t total_needed = (num_data_records * record_size) + revoke_size + commit_size;
+    return jhdr->nbytes_used + total_needed <= journal_size(fs->sb);
+}
+
+/*
+ * Write-back inode cache. Inodes are decoded once and stay cached across
+ * transactions; inode_write only marks the inode dirty. At commit the
+ * dirty inodes are copied into their inode-table blocks, so only blocks
+ * holding a changed inode are logged, and unchanged inodes never send
+ * the tool back to the image.
+ *
+ * Slots are handed out on first use from chunks that never move, so an
+ * inode pointer stays valid while the cache grows. A single sync may
+ * touch more than ICACHE_MAX_INODES inodes, so that is not a hard cap:
+ * icache_trim empties the cache between commands once it is reached.
+ */
+#define ICACHE_CHUNK      256U
+#define ICACHE_MAX_INODES 8192U
+
+struct icache_chunk {
+    struct inode inodes[ICACHE_CHUNK];
+    uint32_t ino[ICACHE_CHUNK];
+    uint8_t dirty[ICACHE_CHUNK];
+};
+
+struct icache {
+    struct block_map slots;     /* inode number -> slot */
+    struct icache_chunk **chunks;
+    uint32_t nchunks;
+    uint32_t count;
+    uint32_t *dirty_list;       /* room for a slot per chunk entry */
+    uint32_t ndirty;
+};
+
+static struct icache *icache_create(void) {
+    struct icache *ic = calloc(1, sizeof(*ic));
+    if (!ic) {
+        die("malloc inode cache");
+    }
+    return ic;
+}
+
+static void icache_free(struct icache *ic) {
+    if (!ic) {
+        return;
+    }
+    block_map_free(&ic->slots);
+    for (uint32_t i = 0; i < ic->nchunks; i++) {
+        free(ic->chunks[i]);
+    }
+    free(ic->chunks);
+    free(ic->dirty_list);
+    free(ic);
+}
+
+static struct icache_chunk *icache_chunk(const struct icache *ic, uint32_t slot) {
+    return ic->chunks[slot / ICACHE_CHUNK];
+}
+
+/* Takes the next free slot for ino; the caller fills in the inode. */
+static uint32_t icache_add(struct icache *ic, uint32_t ino) {
+    uint32_t slot = ic->count++;
+    if (slot / ICACHE_CHUNK == ic->nchunks) {
+        ic->nchunks++;
+        ic->chunks = realloc(ic->chunks, ic->nchunks * sizeof(*ic->chunks));
+        ic->dirty_list = realloc(ic->dirty_list, (size_t)ic->nchunks * ICACHE_CHUNK * sizeof(uint32_t));
+        if (!ic->chunks || !ic->dirty_list) {
+            die("realloc inode cache");
+        }
+        ic->chunks[ic->nchunks - 1] = malloc(sizeof(struct icache_chunk));
+        if (!ic->chunks[ic->nchunks - 1]) {
+            die("malloc inode cache");
+        }
+    }
+    icache_chunk(ic, slot)->ino[slot % ICACHE_CHUNK] = ino;
+    icache_chunk(ic, slot)->dirty[slot % ICACHE_CHUNK] = 0;
+    block_map_set(&ic->slots, ino, slot);
+    return slot;
+}
+
+/*
+ * Forgets every cached inode once the cache is full. Only called right
+ * after fs_flush_inodes, when nothing is dirty and no command holds an
+ * inode pointer; the flushed copies live on in the transaction's blocks.
+ */
+static void icache_trim(struct icache *ic) {
+    if (!ic || ic->count < ICACHE_MAX_INODES) {
+        return;
+    }
+    block_map_clear(&ic->slots);
+    ic->count = 0;
+    while (ic->nchunks > ICACHE_MAX_INODES / ICACHE_CHUNK) {
+        free(ic->chunks[--ic->nchunks]);
+    }
+}
+
+/* Copies dirty cached inodes into their inode-table blocks in txn. */
+static void fs_flush_inodes(struct fs *fs, struct txn *txn) {
+    struct icache *ic = fs->icache;
+    if (!ic) {
+        return;
+    }
+    for (uint32_t i = 0; i < ic->ndirty; i++) {
+        struct icache_chunk *chunk = icache_chunk(ic, ic->dirty_list[i]);
+        uint32_t j = ic->dirty_list[i] % ICACHE_CHUNK;
+        uint32_t ino = chunk->ino[j];
+        uint8_t *block = txn_write(fs, txn, fs->sb->inode_start + ino / INODES_PER_BLOCK);
+        memcpy(block + (ino % INODES_PER_BLOCK) * INODE_SIZE, &chunk->inodes[j], INODE_SIZE);
+        chunk->dirty[j] = 0;
+    }
+    ic->ndirty = 0;
+}
+
+/*
+ * Clears the bitmap bits of blocks freed during the transaction. Until
+ * then the allocator cannot hand them out again, so ordered-mode data is
+ * never written over a block the last committed metadata still uses.
+ */
+static void fs_release_freed(struct fs *fs) {
+    for (uint32_t i = 0; i < fs->nfreed; i++) {
+        bitmap_alloc_clear(&fs->data_alloc, fs->freed[i] - fs->sb->data_start);
+    }
+}
+
+static int u32_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int u64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * With FEATURE_DISCARD, punches the blocks freed by the transaction just
+ * committed out of the image, one fallocate per run of adjacent blocks.
+ * The commit is flushed first: until it is durable, a crash would bring
+ * back metadata that still points at the punched blocks.
+ */
+static void fs_discard_freed(struct fs *fs) {
+    if (!(fs->sb->features & FEATURE_DISCARD) || fs->nfreed == 0) {
+        return;
+    }
+    if (fdatasync(fs->fd) < 0) {
+        die("fdatasync");
+    }
+    qsort(fs->freed, fs->nfreed, sizeof(*fs->freed), u64_cmp);
+    uint32_t i = 0;
+    while (i < fs->nfreed) {
+        uint32_t j = i + 1;
+        while (j < fs->nfreed && fs->freed[j] == fs->freed[j - 1] + 1) {
+            j++;
+        }
+        punch_blocks(fs->fd, fs->freed[i], j - i);
+        i = j;
+    }
+}
+
+/*
+ * Zeroes the home blocks of the inode-table groups this transaction
+ * starts using. Like ordered-mode data they must be on disk before the
+ * commit that clears the groups' uninit flags.
+ */
+static void fs_zero_itable_groups(struct fs *fs) {
+    if (fs->nzero_groups == 0) {
+        return;
+    }
+    uint32_t count = fs->sb->inodes_per_group / INODES_PER_BLOCK;
+    uint8_t *zeros = calloc(count, BLOCK_SIZE);
+    if (!zeros) {
+        die("calloc inode group");
+    }
+    for (uint32_t i = 0; i < fs->nzero_groups; i++) {
+        write_data_blocks(fs->fd, fs->sb->inode_start + (uint64_t)fs->zero_groups[i] * count, zeros, count);
+    }
+    free(zeros);
+    if (fdatasync(fs->fd) < 0) {
+        die("fdatasync");
+    }
+    fs->nzero_groups = 0;
+}
+
+/* Appends every dirty block and a commit record; -1 if the journal is too full. */
+static int txn_commit(struct fs *fs, struct txn *txn) {
+    struct journal_header *jhdr = (struct journal_header *)fs->journal_buf;
+    uint32_t start_offset = jhdr->nbytes_used;
+    uint32_t current_offset = start_offset;
+
+    fs_flush_inodes(fs, txn);
+    if (!txn_fits(fs, txn)) {
+        return -1;
+    }
+    fs_zero_itable_groups(fs);
+
+    uint32_t *revoked = malloc((fs->nfreed ? fs->nfreed : 1) * sizeof(uint32_t));
+    if (!revoked) {
+        die("malloc revoke list");
+    }
+    uint32_t num_revokes = fs_revokes(fs, revoked);
+    fs_release_freed(fs);
+
+    for (uint32_t i = 0; i < txn->count; i++) {
+        if (txn_logs(fs, &txn->blocks[i])) {
+            append_data_record(fs->journal_buf, &current_offset, txn->blocks[i].block_no, txn->blocks[i].data);
+        }
+    }
+    if (num_revokes > 0) {
+        append_revoke_record(fs->journal_buf, &current_offset, revoked, num_revokes);
+    }
+    free(revoked);
+
+    append_commit_record(fs->journal_buf, &current_offset, (uint32_t)fs->inode_alloc.next, fs->data_alloc.next);
+
+    update_journal_header(fs->journal_buf, current_offset);
+
+    journal_index_add(&fs->journal_index, fs->journal_buf, start_offset, current_offset);
+
+    write_journal(fs->fd, fs->sb, fs->journal_buf, start_offset);
+    fs_discard_freed(fs);
+    fs->nfreed = 0;
+    return 0;
+}
+
+/* Adds the bitmap blocks holding bits [first, first + count) to txn. */
+static void fs_attach_bitmap(struct fs *fs, struct txn *txn, uint32_t bitmap_start, uint64_t first, uint32_t count) {
+    for (uint32_t b = (uint32_t)(first / BITS_PER_BLOCK); b <= (first + count - 1) / BITS_PER_BLOCK; b++) {
+        txn_attach(txn, bitmap_start + b, fs_cache_block(fs, bitmap_start + b));
+    }
+}
+
+/* Adds the descriptor block of group g to txn. */
+static void fs_attach_group(struct fs *fs, struct txn *txn, uint32_t g) {
+    uint32_t block_no = fs->sb->group_desc + g / GROUP_DESCS_PER_BLOCK;
+    txn_attach(txn, block_no, fs_cache_block(fs, block_no));
+}
+
+/* Where to start searching group g: the cursor if it is already inside g, else g's first bit. */
+static uint64_t group_goal(uint64_t cursor, uint32_t g, uint32_t per_group) {
+    return cursor / per_group == g ? cursor : (uint64_t)g * per_group;
+}
+
+/* Data allocation goal for blocks owned by inode ino: the data half of its group. */
+static uint64_t fs_data_goal(const struct fs *fs, uint32_t ino) {
+    return group_goal(fs->data_alloc.next, ino / fs->sb->inodes_per_group, fs->sb->blocks_per_group);
+}
+
+/*
+ * Group for a new inode. Files stay with their parent directory so a
+ * directory's inodes, and through fs_data_goal their blocks, share
+ * bitmap and inode-table blocks. Directories are spread out: among the
+ * groups with at least the average number of free inodes, the one with
+ * the most free blocks, as in ext2.
+ */
+static uint32_t fs_inode_group(struct fs *fs, uint32_t parent, uint16_t type) {
+    uint32_t ngroups = fs->sb->group_count;
+    if (type == INODE_DIR) {
+        uint64_t free_inodes = 0;
+        for (uint32_t g = 0; g < ngroups; g++) {
+            free_inodes += fs_group(fs, g)->free_inodes;
+        }
+        uint32_t avg_free = (uint32_t)(free_inodes / ngroups);
+        uint32_t best = (uint32_t)-1;
+        for (uint32_t g = 0; g < ngroups; g++) {
+            const struct group_desc *gd = fs_group(fs, g);
+            if (gd->free_inodes == 0 || gd->free_inodes < avg_free) {
+                continue;
+            }
+            if (best == (uint32_t)-1 || gd->free_blocks > fs_group(fs, best)->free_blocks) {
+                best = g;
+            }
+        }
+        if (best != (uint32_t)-1) {
+            return best;
+        }
+    }
+    uint32_t home = parent / fs->sb->inodes_per_group;
+    for (uint32_t i = 0; i < ngroups; i++) {
+        uint32_t g = (home + i) % ngroups;
+        if (fs_group(fs, g)->free_inodes > 0) {
+            return g;
+        }
+    }
+    return home;
+}
+
+/*
+ * Claims the inode-table slice of group g for this transaction if mkfs
+ * left it uninitialized. Its blocks read as zeros from now on and
+ * txn_commit writes the zeros home before logging the descriptor that
+ * clears the group's flag. Nothing in an uninitialized group is
+ * allocated, so no cached or journaled copy of its blocks can exist.
+ */
+static void fs_init_itable_group(struct fs *fs, struct txn *txn, uint32_t g) {
+    struct group_desc *gd = fs_group(fs, g);
+    if (!(gd->flags & GROUP_INODE_UNINIT)) {
+        return;
+    }
+    if (fs->nzero_groups == fs->zero_groups_capacity) {
+        fs->zero_groups_capacity = fs->zero_groups_capacity ? fs->zero_groups_capacity * 2 : 8;
+        fs->zero_groups = realloc(fs->zero_groups, fs->zero_groups_capacity * sizeof(*fs->zero_groups));
+        if (!fs->zero_groups) {
+            die("realloc zero groups");
+        }
+    }
+    fs->zero_groups[fs->nzero_groups++] = g;
+    gd->flags &= ~GROUP_INODE_UNINIT;
+    fs_attach_group(fs, txn, g);
+}
+
+static uint32_t fs_alloc_inode(struct fs *fs, struct txn *txn, uint32_t parent, uint16_t type) {
+    uint32_t ipg = fs->sb->inodes_per_group;
+    uint32_t goal = group_goal(fs->inode_alloc.next, fs_inode_group(fs, parent, type), ipg);
+    uint32_t ino = (uint32_t)bitmap_alloc_bit(&fs->inode_alloc, goal, fs->sb->inode_count);
+    if (ino == (uint32_t)-1) {
+        return (uint32_t)-1;
+    }
+    if (type == INODE_DIR) {
+        fs_group(fs, ino / ipg)->dirs++;
+        fs_attach_group(fs, txn, ino / ipg);
+    }
+    fs_init_itable_group(fs, txn, ino / ipg);
+    fs_attach_bitmap(fs, txn, fs->sb->inode_bitmap, ino, 1);
+    return ino;
+}
+
+/*
+ * Allocates one block for metadata (directory, index or extent leaf
+ * block) near goal and returns its absolute block number. Metadata
+ * pointers are 32-bit, so in 64-bit images the search stops at 2^32.
+ */
+static uint32_t fs_alloc_block(struct fs *fs, struct txn *txn, uint64_t goal) {
+    uint64_t limit = (1ULL << 32) - fs->sb->data_start;
+    uint64_t bit = bitmap_alloc_bit(&fs->data_alloc, goal, limit);
+    if (bit == (uint64_t)-1) {
+        return (uint32_t)-1;
+    }
+    fs_attach_bitmap(fs, txn, fs->sb->data_bitmap, bit, 1);
+    return (uint32_t)(fs->sb->data_start + bit);
+}
+
+/* Allocates a contiguous run of up to count file data blocks near goal; returns its first absolute block. */
+static uint64_t fs_alloc_run(struct fs *fs, struct txn *txn, uint64_t goal, uint32_t count, uint32_t *len) {
+    uint64_t bit = bitmap_alloc_run(&fs->data_alloc, goal, count, len);
+    if (bit == (uint64_t)-1) {
+        return (uint64_t)-1;
+    }
+    fs_attach_bitmap(fs, txn, fs->sb->data_bitmap, bit, *len);
+    return fs->sb->data_start + bit;
+}
+
+/* Frees a data block when the transaction commits. */
+static void fs_free_block(struct fs *fs, struct txn *txn, uint64_t blk) {
+    if (fs->nfreed == fs->freed_capacity) {
+        fs->freed_capacity = fs->freed_capacity ? fs->freed_capacity * 2 : 64;
+        fs->freed = realloc(fs->freed, fs->freed_capacity * sizeof(*fs->freed));
+        if (!fs->freed) {
+            die("realloc freed blocks");
+        }
+    }
+    fs->freed[fs->nfreed++] = blk;
+    fs_attach_bitmap(fs, txn, fs->sb->data_bitmap, blk - fs->sb->data_start, 1);
+}
+
+static void fs_free_inode(struct fs *fs, struct txn *txn, uint32_t ino) {
+    bitmap_alloc_clear(&fs->inode_alloc, ino);
+    fs_attach_bitmap(fs, txn, fs->sb->inode_bitmap, ino, 1);
+}
+
+/* Cache slot of ino, loading it from txn or the image on first use. */
+static uint32_t icache_slot(struct fs *fs, struct txn *txn, uint32_t ino) {
+    struct icache *ic = fs->icache;
+    uint32_t slot;
+    if (block_map_get(&ic->slots, ino, &slot)) {
+        return slot;
+    }
+    const uint8_t *block = txn_read(fs, txn, fs->sb->inode_start + ino / INODES_PER_BLOCK);
+    slot = icache_add(ic, ino);
+    memcpy(&icache_chunk(ic, slot)->inodes[slot % ICACHE_CHUNK], block + (ino % INODES_PER_BLOCK) * INODE_SIZE,
+           INODE_SIZE);
+    return slot;
+}
+
+static const struct inode *inode_read(struct fs *fs, struct txn *txn, uint32_t ino) {
+    struct icache *ic = fs->icache;
+    if (ic) {
+        uint32_t slot = icache_slot(fs, txn, ino);
+        return &icache_chunk(ic, slot)->inodes[slot % ICACHE_CHUNK];
+    }
+    const uint8_t *block = txn_read(fs, txn, fs->sb->inode_start + ino / INODES_PER_BLOCK);
+    return (const struct inode *)(block + (ino % INODES_PER_BLOCK) * INODE_SIZE);
+}
+
+static struct inode *inode_write(struct fs *fs, struct txn *txn, uint32_t ino) {
+    struct icache *ic = fs->icache;
+    if (ic) {
+        uint32_t slot = icache_slot(fs, txn, ino);
+        struct icache_chunk *chunk = icache_chunk(ic, slot);
+        if (!chunk->dirty[slot % ICACHE_CHUNK]) {
+            chunk->dirty[slot % ICACHE_CHUNK] = 1;
+            ic->dirty_list[ic->ndirty++] = slot;
+        }
+        return &chunk->inodes[slot % ICACHE_CHUNK];
+    }
+    uint8_t *block = txn_write(fs, txn, fs->sb->inode_start + ino / INODES_PER_BLOCK);
+    return (struct inode *)(block + (ino % INODES_PER_BLOCK) * INODE_SIZE);
+}
+
+static void extent_init_root(struct inode *ino) {
+    memset(ino->extent_root, 0, sizeof(ino->extent_root));
+    struct extent_header *hdr = (struct extent_header *)ino->extent_root;
+    hdr->magic = EXTENT_MAGIC;
+    hdr->max = EXTENT_ROOT_ENTRIES;
+    hdr->depth = 0;
+    ino->flags |= INODE_FLAG_EXTENTS;
+}
+
+static uint64_t extent_start(const struct extent *e) {
+    return u64_join(e->start, e->start_hi);
+}
+
+/* Physical block backing file block lblk, or 0 if it is not mapped. */
+static uint64_t inode_bmap(struct fs *fs, struct txn *txn, const struct inode *ino, uint32_t lblk) {
+    if (!(ino->flags & INODE_FLAG_EXTENTS)) {
+        return lblk < DIRECT_POINTERS ? ino->direct[lblk] : 0;
+    }
+
+    const struct extent_header *hdr = (const struct extent_header *)ino->extent_root;
+    if (hdr->entries == 0) {
+        return 0;
+    }
+    if (hdr->depth > 0) {
+        const struct extent_idx *idx = (const struct extent_idx *)(hdr + 1);
+        uint32_t i = hdr->entries - 1;
+        while (i > 0 && idx[i].logical > lblk) {
+            i--;
+        }
+        hdr = (const struct extent_header *)txn_read(fs, txn, idx[i].leaf);
+    }
+
+    const struct extent *ext = (const struct extent *)(hdr + 1);
+    uint32_t lo = 0;
+    uint32_t hi = hdr->entries;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ext[mid].logical <= lblk) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return 0;
+    }
+    const struct extent *e = &ext[lo - 1];
+    if (lblk - e->logical >= e->len) {
+        return 0;
+    }
+    return extent_start(e) + (lblk - e->logical);
+}
+
+/*
+ * Appends (lblk, start, len) after the last mapped block of ino, merging
+ * with the last extent when the blocks are physically contiguous. When
+ * the inline root fills, its extents move to a leaf block and the root
+ * becomes a one-level index.
+ */
+static int inode_append_extent(struct fs *fs, struct txn *txn, struct inode *ino,
+                               uint32_t lblk, uint64_t start, uint32_t len) {
+    struct extent_header *root = (struct extent_header *)ino->extent_root;
+    struct extent_header *leaf = root;
+    uint32_t leaf_blk = 0;
+
+    if (root->depth > 0) {
+        struct extent_idx *idx = (struct extent_idx *)(root + 1);
+        leaf_blk = idx[root->entries - 1].leaf;
+        leaf = (struct extent_header *)txn_write(fs, txn, leaf_blk);
+    }
+
+    struct extent *ext = (struct extent *)(leaf + 1);
+    if (leaf->entries > 0) {
+        struct extent *last = &ext[leaf->entries - 1];
+        if (extent_start(last) + last->len == start && last->logical + last->len == lblk &&
+            last->len + len <= EXTENT_MAX_LEN) {
+            last->len = (uint16_t)(last->len + len);
+            return 0;
+        }
+    }
+    if (leaf->entries < leaf->max) {
+        ext[leaf->entries].logical = lblk;
+        ext[leaf->entries].len = (uint16_t)len;
+        ext[leaf->entries].start_hi = (uint16_t)(start >> 32);
+        ext[leaf->entries].start = (uint32_t)start;
+        leaf->entries++;
+        return 0;
+    }
+
+    if (root->depth == 0) {
+        uint32_t new_blk = fs_alloc_block(fs, txn, start - fs->sb->data_start);
+        if (new_blk == (uint32_t)-1) {
+            fprintf(stderr, "Error: no free data blocks\n");
+            return -1;
+        }
+        struct extent_header *new_leaf = (struct extent_header *)txn_new(txn, new_blk);
+        new_leaf->magic = EXTENT_MAGIC;
+        new_leaf->max = EXTENT_LEAF_ENTRIES;
+        new_leaf->entries = root->entries;
+        memcpy(new_leaf + 1, root + 1, root->entries * sizeof(struct extent));
+
+        struct extent_idx *idx = (struct extent_idx *)(root + 1);
+        memset(idx, 0, root->max * sizeof(struct extent));
+        idx[0].logical = ((struct extent *)(new_leaf + 1))[0].logical;
+        idx[0].leaf = new_blk;
+        root->entries = 1;
+        root->depth = 1;
+        return inode_append_extent(fs, txn, ino, lblk, start, len);
+    }
+
+    if (root->entries == root->max) {
+        fprintf(stderr, "Error: file has too many extents\n");
+        return -1;
+    }
+    uint32_t new_blk = fs_alloc_block(fs, txn, start - fs->sb->data_start);
+    if (new_blk == (uint32_t)-1) {
+        fprintf(stderr, "Error: no free data blocks\n");
+        return -1;
+    }
+    struct extent_header *new_leaf = (struct extent_header *)txn_new(txn, new_blk);
+    new_leaf->magic = EXTENT_MAGIC;
+    new_leaf->max = EXTENT_LEAF_ENTRIES;
+    struct extent_idx *idx = (struct extent_idx *)(root + 1);
+    idx[root->entries].logical = lblk;
+    idx[root->entries].leaf = new_blk;
+    root->entries++;
+    return inode_append_extent(fs, txn, ino, lblk, start, len);
+}
+
+/*
+ * Maps count new blocks at file block lblk (the current end of an
+ * extent-mapped file), allocating them as few contiguous runs near goal
+ * as the free space allows. Only the mapping is logged; the caller
+ * writes the block contents.
+ */
+static int inode_grow(struct fs *fs, struct txn *txn, struct inode *ino, uint64_t goal,
+                      uint32_t lblk, uint32_t count) {
+    while (count > 0) {
+        uint32_t want = count < EXTENT_MAX_LEN ? count : EXTENT_MAX_LEN;
+        uint32_t len;
+        uint64_t start = fs_alloc_run(fs, txn, goal, want, &len);
+        if (start == (uint64_t)-1) {
+            fprintf(stderr, "Error: no free data blocks\n");
+            return -1;
+        }
+        if (inode_append_extent(fs, txn, ino, lblk, start, len) < 0) {
+            return -1;
+        }
+        goal = start + len - fs->sb->data_start;
+        lblk += len;
+        count -= len;
+    }
+    return 0;
+}
+
+/* Frees every block the inode maps, including extent leaves. */
+static void inode_free_blocks(struct fs *fs, struct txn *txn, const struct inode *ino) {
+    if (ino->flags & INODE_FLAG_INLINE) {
+        return;
+    }
+    if (!(ino->flags & INODE_FLAG_EXTENTS)) {
+        for (uint32_t d = 0; d < DIRECT_POINTERS; d++) {
+            if (ino->direct[d] != 0) {
+                fs_free_block(fs, txn, ino->direct[d]);
+            }
+        }
+        return;
+    }
+
+    const struct extent_header *root = (const struct extent_header *)ino->extent_root;
+    for (uint32_t i = 0; i < root->entries; i++) {
+        const struct extent_header *leaf = root;
+        uint32_t first = i, last = i + 1;
+        if (root->depth > 0) {
+            const struct extent_idx *idx = (const struct extent_idx *)(root + 1);
+            leaf = (const struct extent_header *)txn_read(fs, txn, idx[i].leaf);
+            first = 0;
+            last = leaf->entries;
+        }
+        const struct extent *ext = (const struct extent *)(leaf + 1);
+        for (uint32_t e = first; e < last; e++) {
+            for (uint32_t b = 0; b < ext[e].len; b++) {
+                fs_free_block(fs, txn, extent_start(&ext[e]) + b);
+            }
+        }
+        if (root->depth > 0) {
+            fs_free_block(fs, txn, ((const struct extent_idx *)(root + 1))[i].leaf);
+        }
+    }
+}
+
+static void inline_data_read(const struct inode *ino, uint8_t *dst) {
+    uint32_t head = ino->size < sizeof(ino->direct) ? ino->size : sizeof(ino->direct);
+    memcpy(dst, ino->direct, head);
+    memcpy(dst + head, ino->inline_tail, ino->size - head);
+}
+
+static void inline_data_store(struct inode *ino, const uint8_t *src, uint32_t len) {
+    uint32_t head = len < sizeof(ino->direct) ? len : sizeof(ino->direct);
+    memset(ino->direct, 0, sizeof(ino->direct));
+    memset(ino->inline_tail, 0, sizeof(ino->inline_tail));
+    memcpy(ino->direct, src, head);
+    memcpy(ino->inline_tail, src + head, len - head);
+    ino->flags = (ino->flags & ~INODE_FLAG_EXTENTS) | INODE_FLAG_INLINE;
+}
+
+static int dirent_is_free(const struct dirent *de) {
+    return de->inode == 0 && de->name[0] == '\0';
+}
+
+/*
+ * Linear search of n dirents for name. Returns the matching index or -1
+ * and stores the first free index (or -1) in *free_idx.
+ */
+static uint32_t dirent_scan_scalar(const struct dirent *entries, uint32_t n, const char *name,
+                                   uint32_t *free_idx) {
+    size_t len = strlen(name);
+    *free_idx = (uint32_t)-1;
+    for (uint32_t i = 0; i < n; i++) {
+        if (dirent_is_free(&entries[i])) {
+            if (*free_idx == (uint32_t)-1) {
+                *free_idx = i;
+            }
+            continue;
+        }
+        if (memcmp(entries[i].name, name, len + 1) == 0) {
+            return i;
+        }
+    }
+    return (uint32_t)-1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * A dirent is exactly one 256-bit register. Each entry is compared
+ * bytewise against a template holding the target name (and its NUL) at
+ * the name offset, and against zero for the free-slot test; eight
+ * entries are folded into match and free masks per iteration.
+ */
+__attribute__((target("avx2")))
+static uint32_t dirent_scan_avx2(const struct dirent *entries, uint32_t n, const char *name,
+                                 uint32_t *free_idx) {
+    size_t len = strlen(name);
+    struct dirent pattern;
+    memset(&pattern, 0, sizeof(pattern));
+    memcpy(pattern.name, name, len);
+
+    const __m256i target = _mm256_loadu_si256((const __m256i *)&pattern);
+    const __m256i zero = _mm256_setzero_si256();
+    const uint32_t name_mask = (uint32_t)(((1ULL << (len + 1)) - 1) << offsetof(struct dirent, name));
+    const uint32_t free_mask = (1U << (offsetof(struct dirent, name) + 1)) - 1;
+
+    *free_idx = (uint32_t)-1;
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint32_t hits = 0;
+        uint32_t frees = 0;
+        for (uint32_t k = 0; k < 8; k++) {
+            __m256i e = _mm256_loadu_si256((const __m256i *)&entries[i + k]);
+            uint32_t eq = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(e, target));
+            uint32_t z = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(e, zero));
+            hits |= (uint32_t)((eq & name_mask) == name_mask) << k;
+            frees |= (uint32_t)((z & free_mask) == free_mask) << k;
+        }
+        if (frees && *free_idx == (uint32_t)-1) {
+            *free_idx = i + (uint32_t)__builtin_ctz(frees);
+        }
+        hits &= ~frees;
+        if (hits) {
+            return i + (uint32_t)__builtin_ctz(hits);
+        }
+    }
+
+    uint32_t tail_free;
+    uint32_t found = dirent_scan_scalar(entries + i, n - i, name, &tail_free);
+    if (*free_idx == (uint32_t)-1 && tail_free != (uint32_t)-1) {
+        *free_idx = i + tail_free;
+    }
+    return found == (uint32_t)-1 ? found : i + found;
+}
+#endif
+
+static uint32_t dirent_scan(const struct dirent *entries, uint32_t n, const char *name, uint32_t *free_idx) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpu_has_avx2()) {
+        return dirent_scan_avx2(entries, n, name, free_idx);
+    }
+#endif
+    return dirent_scan_scalar(entries, n, name, free_idx);
+}
+
+/* Directory blocks are allocated by fs_alloc_block, so they always fit in 32 bits. */
+static uint32_t dir_slot_block(struct fs *fs, struct txn *txn, const struct inode *dir, uint32_t slot) {
+    return (uint32_t)inode_bmap(fs, txn, dir, slot / DIRENTS_PER_BLOCK);
+}
+
+static const struct dirent *dir_entry_read(struct fs *fs, struct txn *txn, const struct inode *dir, uint32_t slot) {
+    const uint8_t *block = txn_read(fs, txn, dir_slot_block(fs, txn, dir, slot));
+    return (const struct dirent *)block + slot % DIRENTS_PER_BLOCK;
+}
+
+static struct dirent *dir_entry_write(struct fs *fs, struct txn *txn, const struct inode *dir, uint32_t slot) {
+    uint8_t *block = txn_write(fs, txn, dir_slot_block(fs, txn, dir, slot));
+    return (struct dirent *)block + slot % DIRENTS_PER_BLOCK;
+}
+
+/*
+ * Maps a new, empty block at directory block lblk, next to the previous
+ * one when possible so the directory stays a single extent. Directories
+ * from older images still map their blocks through direct[]; the first
+ * time one grows, its blocks move into an extent root.
+ */
+static int dir_grow(struct fs *fs, struct txn *txn, uint32_t dir_ino, struct inode *dir, uint32_t lblk) {
+    if (!(dir->flags & INODE_FLAG_EXTENTS)) {
+        uint32_t direct[DIRECT_POINTERS];
+        memcpy(direct, dir->direct, sizeof(direct));
+        extent_init_root(dir);
+        for (uint32_t b = 0; b < lblk; b++) {
+            if (inode_append_extent(fs, txn, dir, b, direct[b], 1) < 0) {
+                return -1;
+            }
+        }
+    }
+    uint64_t goal = lblk > 0 ? inode_bmap(fs, txn, dir, lblk - 1) + 1 - fs->sb->data_start : fs_data_goal(fs, dir_ino);
+    uint32_t blk = fs_alloc_block(fs, txn, goal);
+    if (blk == (uint32_t)-1) {
+        fprintf(stderr, "Error: no free data blocks\n");
+        return -1;
+    }
+    txn_new(txn, blk);
+    return inode_append_extent(fs, txn, dir, lblk, blk, 1);
+}
+
+/* FNV-1a over the name; the index uses the low bits to pick a leaf. */
+static uint32_t dx_hash(const char *name) {
+    uint32_t hash = 2166136261U;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* Filter positions come from the FNV-1a name hash and a remix of it (double hashing). */
+static void bloom_positions(const char *name, uint32_t pos[DIR_BLOOM_HASHES]) {
+    uint32_t h1 = dx_hash(name);
+    uint32_t h2 = (h1 ^ (h1 >> 16)) * 0x85EBCA6BU;
+    h2 = (h2 ^ (h2 >> 13)) | 1U;
+    for (uint32_t i = 0; i < DIR_BLOOM_HASHES; i++) {
+        pos[i] = (h1 + i * h2) % (DIR_BLOOM_BYTES * 8);
+    }
+}
+
+static void bloom_add(uint8_t *bloom, const char *name) {
+    uint32_t pos[DIR_BLOOM_HASHES];
+    bloom_positions(name, pos);
+    for (uint32_t i = 0; i < DIR_BLOOM_HASHES; i++) {
+        bitmap_set(bloom, pos[i]);
+    }
+}
+
+/* Whether at least half the filter's bits are set, so most lookups get a false positive. */
+static int bloom_saturated(const uint8_t *bloom) {
+    uint32_t set = 0;
+    for (uint32_t i = 0; i < DIR_BLOOM_BYTES; i++) {
+        set += (uint32_t)__builtin_popcount(bloom[i]);
+    }
+    return set >= DIR_BLOOM_BYTES * 8 / 2;
+}
+
+/* Recomputes a directory's filter from its live entries, dropping removed names. */
+static void bloom_rebuild(struct fs *fs, struct txn *txn, uint32_t dir_ino) {
+    struct inode *dir = inode_write(fs, txn, dir_ino);
+    memset(dir->bloom, 0, sizeof(dir->bloom));
+    uint32_t nslots = dir->size / sizeof(struct dirent);
+    for (uint32_t slot = 0; slot < nslots; slot++) {
+        const struct dirent *de = dir_entry_read(fs, txn, dir, slot);
+        if (!dirent_is_free(de)) {
+            bloom_add(dir->bloom, de->name);
+        }
+    }
+}
+
+static int bloom_may_contain(const uint8_t *bloom, const char *name) {
+    uint32_t pos[DIR_BLOOM_HASHES];
+    bloom_positions(name, pos);
+    for (uint32_t i = 0; i < DIR_BLOOM_HASHES; i++) {
+        if (!bitmap_test(bloom, pos[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static uint32_t dx_lookup(struct fs *fs, struct txn *txn, const struct inode *dir, const char *name) {
+    uint32_t hash = dx_hash(name);
+    const struct dx_root *root = (const struct dx_root *)txn_read(fs, txn, dir->dx_root);
+    uint32_t leaf_blk = root->leaves[hash & ((1U << root->depth) - 1)];
+    const struct dx_leaf *leaf = (const struct dx_leaf *)txn_read(fs, txn, leaf_blk);
+
+    for (uint32_t i = 0; i < leaf->count; i++) {
+        if (leaf->entries[i].hash != hash) {
+            continue;
+        }
+        const struct dirent *de = dir_entry_read(fs, txn, dir, leaf->entries[i].slot);
+        if (strcmp(de->name, name) == 0) {
+            return leaf->entries[i].slot;
+        }
+    }
+    return (uint32_t)-1;
+}
+
+static int dx_insert(struct fs *fs, struct txn *txn, const struct inode *dir, uint32_t hash, uint32_t slot) {
+    for (;;) {
+        const struct dx_root *root = (const struct dx_root *)txn_read(fs, txn, dir->dx_root);
+        uint32_t leaf_blk = root->leaves[hash & ((1U << root->depth) - 1)];
+        const struct dx_leaf *leaf = (const struct dx_leaf *)txn_read(fs, txn, leaf_blk);
+
+        if (leaf->count < DX_LEAF_ENTRIES) {
+            struct dx_leaf *wleaf = (struct dx_leaf *)txn_write(fs, txn, leaf_blk);
+            wleaf->entries[wleaf->count].hash = hash;
+            wleaf->entries[wleaf->count].slot = slot;
+            wleaf->count++;
+            return 0;
+        }
+
+        if (leaf->depth == root->depth && root->depth == DX_MAX_DEPTH) {
+            fprintf(stderr, "Error: directory index is full\n");
+            return -1;
+        }
+        uint32_t new_blk = fs_alloc_block(fs, txn, dir->dx_root - fs->sb->data_start);
+        if (new_blk == (uint32_t)-1) {
+            fprintf(stderr, "Error: no free data blocks\n");
+            return -1;
+        }
+
+        struct dx_root *wroot = (struct dx_root *)txn_write(fs, txn, dir->dx_root);
+        if (leaf->depth == wroot->depth) {
+            uint32_t n = 1U << wroot->depth;
+            memcpy(&wroot->leaves[n], wroot->leaves, n * sizeof(wroot->leaves[0]));
+            wroot->depth++;
+        }
+
+        struct dx_leaf *old_leaf = (struct dx_leaf *)txn_write(fs, txn, leaf_blk);
+        struct dx_leaf *new_leaf = (struct dx_leaf *)txn_new(txn, new_blk);
+        uint32_t split_bit = 1U << old_leaf->depth;
+        old_leaf->depth++;
+        new_leaf->magic = DX_LEAF_MAGIC;
+        new_leaf->depth = old_leaf->depth;
+
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < old_leaf->count; i++) {
+            if (old_leaf->entries[i].hash & split_bit) {
+                new_leaf->entries[new_leaf->count++] = old_leaf->entries[i];
+            } else {
+                old_leaf->entries[kept++] = old_leaf->entries[i];
+            }
+        }
+        old_leaf->count = kept;
+
+        for (uint32_t i = 0; i < (1U << wroot->depth); i++) {
+            if (wroot->leaves[i] == leaf_blk && (i & split_bit)) {
+                wroot->leaves[i] = new_blk;
+            }
+        }
+    }
+}
+
+/* Drops the index entry for slot; leaves are never merged. */
+static void dx_remove(struct fs *fs, struct txn *txn, const struct inode *dir, uint32_t hash, uint32_t slot) {
+    const struct dx_root *root = (const struct dx_root *)txn_read(fs, txn, dir->dx_root);
+    uint32_t leaf_blk = root->leaves[hash & ((1U << root->depth) - 1)];
+    struct dx_leaf *leaf = (struct dx_leaf *)txn_write(fs, txn, leaf_blk);
+
+    for (uint32_t i = 0; i < leaf->count; i++) {
+        if (leaf->entries[i].slot == slot) {
+            leaf->entries[i] = leaf->entries[--leaf->count];
+            return;
+        }
+    }
+}
+
+/* Converts a linear directory to an indexed one, indexing its existing entries. */
+static int dx_build(struct fs *fs, struct txn *txn, uint32_t dir_ino) {
+    uint32_t root_blk = fs_alloc_block(fs, txn, fs_data_goal(fs, dir_ino));
+    uint32_t leaf_blk = root_blk == (uint32_t)-1 ? (uint32_t)-1 : fs_alloc_block(fs, txn, root_blk + 1 - fs->sb->data_start);
+    if (leaf_blk == (uint32_t)-1) {
+        fprintf(stderr, "Error: no free data blocks\n");
+        return -1;
+    }
+
+    struct dx_root *root = (struct dx_root *)txn_new(txn, root_blk);
+    root->magic = DX_ROOT_MAGIC;
+    root->depth = 0;
+    root->leaves[0] = leaf_blk;
+    struct dx_leaf *leaf = (struct dx_leaf *)txn_new(txn, leaf_blk);
+    leaf->magic = DX_LEAF_MAGIC;
+    leaf->depth = 0;
+
+    /* The index answers lookups directly, and a filter this small would be saturated anyway. */
+    struct inode *dir = inode_write(fs, txn, dir_ino);
+    dir->flags = (dir->flags | INODE_FLAG_INDEX) & ~INODE_FLAG_BLOOM;
+    memset(dir->bloom, 0, sizeof(dir->bloom));
+    dir->dx_root = root_blk;
+
+    uint32_t nslots = dir->size / sizeof(struct dirent);
+    for (uint32_t slot = 0; slot < nslots; slot++) {
+        const struct dirent *de = dir_entry_read(fs, txn, dir, slot);
+        if (dirent_is_free(de)) {
+            continue;
+        }
+        if (dx_insert(fs, txn, dir, dx_hash(de->name), slot) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Slot of name in dir, or -1. For linear directories *free_slot receives
+ * the first reusable slot below dir->size (or -1); indexed directories,
+ * and names the directory's Bloom filter rules out without a scan,
+ * report -1 there and append.
+ */
+static uint32_t dir_lookup(struct fs *fs, struct txn *txn, const struct inode *dir, const char *name,
+                           uint32_t *free_slot) {
+    *free_slot = (uint32_t)-1;
+    if (dir->flags & INODE_FLAG_INDEX) {
+        return dx_lookup(fs, txn, dir, name);
+    }
+    if ((dir->flags & INODE_FLAG_BLOOM) && !bloom_may_contain(dir->bloom, name)) {
+        return (uint32_t)-1;
+    }
+
+    uint32_t nslots = dir->size / sizeof(struct dirent);
+    for (uint32_t base = 0; base < nslots; base += DIRENTS_PER_BLOCK) {
+        uint32_t n = nslots - base < DIRENTS_PER_BLOCK ? nslots - base : DIRENTS_PER_BLOCK;
+        const struct dirent *entries = (const struct dirent *)txn_read(fs, txn, dir_slot_block(fs, txn, dir, base));
+        uint32_t free_idx;
+        uint32_t found = dirent_scan(entries, n, name, &free_idx);
+        if (*free_slot == (uint32_t)-1 && free_idx != (uint32_t)-1) {
+            *free_slot = base + free_idx;
+        }
+        if (found != (uint32_t)-1) {
+            return base + found;
+        }
+    }
+    return (uint32_t)-1;
+}
+
+/*
+ * Stores name -> ino in slot (or appends when slot is -1), keeping the
+ * directory index, if any, in step. Appending past the last block maps
+ * a new one in the same transaction.
+ */
+static int dir_add_entry(struct fs *fs, struct txn *txn, uint32_t dir_ino, const char *name, uint32_t ino,
+                         uint32_t slot) {
+    struct inode *dir = inode_write(fs, txn, dir_ino);
+    uint32_t end_slot = dir->size / sizeof(struct dirent);
+    if (slot == (uint32_t)-1 && end_slot % DIRENTS_PER_BLOCK == 0) {
+        /* Reuse a slot freed by rm before growing by a block; none below the hint is free. */
+        for (uint32_t s = dir->free_hint; s < end_slot && slot == (uint32_t)-1; s++) {
+            if (dirent_is_free(dir_entry_read(fs, txn, dir, s))) {
+                slot = s;
+            }
+        }
+        dir->free_hint = slot == (uint32_t)-1 ? end_slot : slot;
+    }
+    if (slot == (uint32_t)-1) {
+        slot = end_slot;
+    }
+    if (slot == end_slot && end_slot % DIRENTS_PER_BLOCK == 0) {
+        if (dir_grow(fs, txn, dir_ino, dir, end_slot / DIRENTS_PER_BLOCK) < 0) {
+            return -1;
+        }
+    }
+
+    struct dirent *de = dir_entry_write(fs, txn, dir, slot);
+    de->inode = ino;
+    strncpy(de->name, name, NAME_LEN - 1);
+    de->name[NAME_LEN - 1] = '\0';
+
+    if (slot == end_slot) {
+        dir->size += sizeof(struct dirent);
+    }
+    if (slot == dir->free_hint) {
+        dir->free_hint = slot + 1;
+    }
+    dir->mtime = (uint32_t)time(NULL);
+
+    if (dir->flags & INODE_FLAG_INDEX) {
+        return dx_insert(fs, txn, dir, dx_hash(name), slot);
+    }
+    if (dir->size / sizeof(struct dirent) > DX_MIN_ENTRIES) {
+        return dx_build(fs, txn, dir_ino);
+    }
+    /* Names removed by rm leave their bits set; a linear directory is small enough to rebuild. */
+    if (dir->flags & INODE_FLAG_BLOOM) {
+        bloom_add(dir->bloom, name);
+        if (bloom_saturated(dir->bloom)) {
+            bloom_rebuild(fs, txn, dir_ino);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Dentry cache: (parent inode, name) -> inode, with LRU eviction. Entries
+ * are linked by index into hash chains and one LRU list, so lookups of
+ * recently used path components skip the directory blocks entirely. Only
+ * positive entries are cached, and the owning command keeps them in step
+ * with creates and unlinks.
+ */
+#define DCACHE_ENTRIES 256
+#define DCACHE_BUCKETS 128
+#define DCACHE_NONE    ((uint32_t)-1)
+
+struct dcache_entry {
+    uint32_t parent;
+    uint32_t ino;
+    char name[NAME_LEN];
+    uint32_t hash_next;
+    uint32_t lru_prev;
+    uint32_t lru_next;
+};
+
+struct dcache {
+    struct dcache_entry entries[DCACHE_ENTRIES];
+    uint32_t buckets[DCACHE_BUCKETS];
+    uint32_t lru_head;
+    uint32_t lru_tail;
+    uint32_t used;
+};
+
+static struct dcache *dcache_create(void) {
+    struct dcache *dc = malloc(sizeof(*dc));
+    if (!dc) {
+        die("malloc dentry cache");
+    }
+    for (uint32_t i = 0; i < DCACHE_BUCKETS; i++) {
+        dc->buckets[i] = DCACHE_NONE;
+    }
+    dc->lru_head = DCACHE_NONE;
+    dc->lru_tail = DCACHE_NONE;
+    dc->used = 0;
+    return dc;
+}
+
+static uint32_t dcache_bucket(uint32_t parent, const char *name) {
+    return (dx_hash(name) ^ (parent * 2654435761U)) % DCACHE_BUCKETS;
+}
+
+static void dcache_lru_unlink(struct dcache *dc, uint32_t i) {
+    struct dcache_entry *e = &dc->entries[i];
+    if (e->lru_prev != DCACHE_NONE) {
+        dc->entries[e->lru_prev].lru_next = e->lru_next;
+    } else {
+        dc->lru_head = e->lru_next;
+    }
+    if (e->lru_next != DCACHE_NONE) {
+        dc->entries[e->lru_next].lru_prev = e->lru_prev;
+    } else {
+        dc->lru_tail = e->lru_prev;
+    }
+}
+
+static void dcache_lru_push(struct dcache *dc, uint32_t i) {
+    struct dcache_entry *e = &dc->entries[i];
+    e->lru_prev = DCACHE_NONE;
+    e->lru_next = dc->lru_head;
+    if (dc->lru_head != DCACHE_NONE) {
+        dc->entries[dc->lru_head].lru_prev = i;
+    } else {
+        dc->lru_tail = i;
+    }
+    dc->lru_head = i;
+}
+
+/* Unlinks the entry for (parent, name) from its hash chain; returns its index or DCACHE_NONE. */
+static uint32_t dcache_unhash(struct dcache *dc, uint32_t parent, const char *name) {
+    uint32_t *link = &dc->buckets[dcache_bucket(parent, name)];
+    while (*link != DCACHE_NONE) {
+        struct dcache_entry *e = &dc->entries[*link];
+        if (e->parent == parent && strcmp(e->name, name) == 0) {
+            uint32_t i = *link;
+            *link = e->hash_next;
+            return i;
+        }
+        link = &e->hash_next;
+    }
+    return DCACHE_NONE;
+}
+
+static uint32_t dcache_lookup(struct dcache *dc, uint32_t parent, const char *name) {
+    uint32_t i = dc->buckets[dcache_bucket(parent, name)];
+    while (i != DCACHE_NONE) {
+        struct dcache_entry *e = &dc->entries[i];
+        if (e->parent == parent && strcmp(e->name, name) == 0) {
+            dcache_lru_unlink(dc, i);
+            dcache_lru_push(dc, i);
+            return e->ino;
+        }
+        i = e->hash_next;
+    }
+    return (uint32_t)-1;
+}
+
+static void dcache_remove(struct dcache *dc, uint32_t parent, const char *name) {
+    uint32_t i = dcache_unhash(dc, parent, name);
+    if (i == DCACHE_NONE) {
+        return;
+    }
+    dcache_lru_unlink(dc, i);
+    /* Keep the live entries packed in [0, used). */
+    uint32_t last = --dc->used;
+    if (i != last) {
+        struct dcache_entry *moved = &dc->entries[last];
+        uint32_t *link = &dc->buckets[dcache_bucket(moved->parent, moved->name)];
+        while (*link != last) {
+            link = &dc->entries[*link].hash_next;
+        }
+        *link = i;
+        if (moved->lru_prev != DCACHE_NONE) {
+            dc->entries[moved->lru_prev].lru_next = i;
+        } else {
+            dc->lru_head = i;
+        }
+        if (moved->lru_next != DCACHE_NONE) {
+            dc->entries[moved->lru_next].lru_prev = i;
+        } else {
+            dc->lru_tail = i;
+        }
+        dc->entries[i] = *moved;
+    }
+}
+
+static void dcache_insert(struct dcache *dc, uint32_t parent, const char *name, uint32_t ino) {
+    uint32_t i = dcache_unhash(dc, parent, name);
+    if (i != DCACHE_NONE) {
+        dcache_lru_unlink(dc, i);
+    } else if (dc->used < DCACHE_ENTRIES) {
+        i = dc->used++;
+    } else {
+        i = dc->lru_tail;
+        dcache_lru_unlink(dc, i);
+        dcache_unhash(dc, dc->entries[i].parent, dc->entries[i].name);
+    }
+
+    struct dcache_entry *e = &dc->entries[i];
+    e->parent = parent;
+    e->ino = ino;
+    strncpy(e->name, name, NAME_LEN - 1);
+    e->name[NAME_LEN - 1] = '\0';
+    uint32_t bucket = dcache_bucket(parent, name);
+    e->hash_next = dc->buckets[bucket];
+    dc->buckets[bucket] = i;
+    dcache_lru_push(dc, i);
+}
+
+/* Inode that name refers to in directory parent, or -1. */
+static uint32_t dir_find(struct fs *fs, struct txn *txn, uint32_t parent, const char *name) {
+    if (fs->dcache) {
+        uint32_t ino = dcache_lookup(fs->dcache, parent, name);
+        if (ino != (uint32_t)-1) {
+            return ino;
+        }
+    }
+
+    const struct inode *dir = inode_read(fs, txn, parent);
+    uint32_t free_slot;
+    uint32_t slot = dir_lookup(fs, txn, dir, name, &free_slot);
+    if (slot == (uint32_t)-1) {
+        return (uint32_t)-1;
+    }
+    uint32_t ino = dir_entry_read(fs, txn, dir, slot)->inode;
+    if (fs->dcache) {
+        dcache_insert(fs->dcache, parent, name, ino);
+    }
+    return ino;
+}
+
+/*
+ * Resolves every component of path but the last, starting at the root.
+ * On success *parent is the directory holding the final component, which
+ * is copied to leaf (NAME_LEN bytes).
+ */
+static int path_parent(struct fs *fs, struct txn *txn, const char *path, uint32_t *parent, char *leaf) {
+    uint32_t dir = 0;
+    const char *p = path;
+    for (;;) {
+        while (*p == '/') {
+            p++;
+        }
+        size_t len = strcspn(p, "/");
+        if (len == 0) {
+            fprintf(stderr, "Error: invalid path '%s'\n", path);
+            return -1;
+        }
+        if (len >= NAME_LEN) {
+            fprintf(stderr, "Error: filename too long (max %d chars)\n", NAME_LEN - 1);
+            return -1;
+        }
+        char name[NAME_LEN];
+        memcpy(name, p, len);
+        name[len] = '\0';
+
+        const char *rest = p + len;
+        while (*rest == '/') {
+            rest++;
+        }
+        if (*rest == '\0') {
+            *parent = dir;
+            memcpy(leaf, name, len + 1);
+            return 0;
+        }
+
+        uint32_t ino = dir_find(fs, txn, dir, name);
+        if (ino == (uint32_t)-1) {
+            fprintf(stderr, "Error: directory '%.*s' not found\n", (int)(p + len - path), path);
+            return -1;
+        }
+        if (inode_read(fs, txn, ino)->type != INODE_DIR) {
+            fprintf(stderr, "Error: '%.*s' is not a directory\n", (int)(p + len - path), path);
+            return -1;
+        }
+        dir = ino;
+        p = rest;
+    }
+}
+
+/* Adds an empty file or directory at path within txn; returns its inode or -1. */
+static uint32_t fs_create_node(struct fs *fs, struct txn *txn, const char *path, uint16_t type) {
+    uint32_t parent;
+    char name[NAME_LEN];
+    if (path_parent(fs, txn, path, &parent, name) < 0) {
+        return (uint32_t)-1;
+    }
+
+    const struct inode *parent_inode = inode_read(fs, txn, parent);
+    uint32_t free_slot;
+    if (dir_lookup(fs, txn, parent_inode, name, &free_slot) != (uint32_t)-1) {
+        fprintf(stderr, "Error: file '%s' already exists\n", path);
+        return (uint32_t)-1;
+    }
+
+    uint32_t free_inode = fs_alloc_inode(fs, txn, parent, type);
+    if (free_inode == (uint32_t)-1) {
+        fprintf(stderr, "Error: no free inodes\n");
+        return (uint32_t)-1;
+    }
+
+    struct inode *new_inode = inode_write(fs, txn, free_inode);
+    memset(new_inode, 0, sizeof(*new_inode));
+    new_inode->type = type;
+    new_inode->links = 1;
+    new_inode->size = 0;
+    time_t now = time(NULL);
+    new_inode->ctime = (uint32_t)now;
+    new_inode->mtime = (uint32_t)now;
+
+    if (type == INODE_DIR) {
+        uint32_t blk = fs_alloc_block(fs, txn, fs_data_goal(fs, free_inode));
+        if (blk == (uint32_t)-1) {
+            fprintf(stderr, "Error: no free data blocks\n");
+            return (uint32_t)-1;
+        }
+        struct dirent *entries = (struct dirent *)txn_new(txn, blk);
+        entries[0].inode = free_inode;
+        strcpy(entries[0].name, ".");
+        entries[1].inode = parent;
+        strcpy(entries[1].name, "..");
+        new_inode->flags = INODE_FLAG_BLOOM;
+        extent_init_root(new_inode);
+        if (inode_append_extent(fs, txn, new_inode, 0, blk, 1) < 0) {
+            return (uint32_t)-1;
+        }
+        new_inode->size = 2 * sizeof(struct dirent);
+        new_inode->free_hint = 2;
+        new_inode->links = 2;
+        bloom_add(new_inode->bloom, ".");
+        bloom_add(new_inode->bloom, "..");
+        inode_write(fs, txn, parent)->links++;
+    } else {
+        extent_init_root(new_inode);
+    }
+
+    if (dir_add_entry(fs, txn, parent, name, free_inode, free_slot) < 0) {
+        return (uint32_t)-1;
+    }
+    if (fs->dcache) {
+        dcache_insert(fs->dcache, parent, name, free_inode);
+    }
+    return free_inode;
+}
+
+static int fs_create(struct fs *fs, struct txn *txn, const char *path) {
+    return fs_create_node(fs, txn, path, INODE_FILE) == (uint32_t)-1 ? -1 : 0;
+}
+
+static int fs_mkdir(struct fs *fs, struct txn *txn, const char *path) {
+    return fs_create_node(fs, txn, path, INODE_DIR) == (uint32_t)-1 ? -1 : 0;
+}
+
+static void cmd_create(const char *image_path, const char *filename) {
+    struct fs fs;
+    fs_open(&fs, image_path);
+    struct txn txn = {0};
+
+    if (fs_create(&fs, &txn, filename) < 0) {
+        txn_free(&txn);
+        fs_close(&fs);
+        exit(EXIT_FAILURE);
+    }
+
+    if (txn_commit(&fs, &txn) < 0) {
+        fprintf(stderr, "Error: insufficient journal space. Install journal!\n");
+        txn_free(&txn);
+        fs_close(&fs);
+        exit(EXIT_FAILURE);
+    }
 
-    while (offset < nbytes_used) {
-        struct rec_header *hdr = (struct rec_header *)(journal_buf + offset);
-        
-        if (offset + sizeof(struct rec_header) > nbytes_used) {
+    txn_free(&txn);
+    fs_close(&fs);
+
+    printf("Created file '%s'\n", filename);
+}
+
+static void cmd_mkdir(const char *image_path, const char *path) {
+    struct fs fs;
+    fs_open(&fs, image_path);
+    struct txn txn = {0};
+
+    if (fs_mkdir(&fs, &txn, path) < 0) {
+        txn_free(&txn);
+        fs_close(&fs);
+        exit(EXIT_FAILURE);
+    }
+
+    if (txn_commit(&fs, &txn) < 0) {
+        fprintf(stderr, "Error: insufficient journal space. Install journal!\n");
+        txn_free(&txn);
+        fs_close(&fs);
+        exit(EXIT_FAILURE);
+    }
+
+    txn_free(&txn);
+    fs_close(&fs);
+
+    printf("Created directory '%s'\n", path);
+}
+
+static uint8_t *read_source_file(const char *path, uint32_t *len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        die("open source");
+    }
+    size_t capacity = BLOCK_SIZE;
+    size_t used = 0;
+    uint8_t *buf = malloc(capacity);
+    if (!buf) {
+        die("malloc source");
+    }
+    for (;;) {
+        if (used == capacity) {
+            capacity *= 2;
+            buf = realloc(buf, capacity);
+            if (!buf) {
+                die("realloc source");
+            }
+        }
+        ssize_t n = read(fd, buf + used, capacity - used);
+        if (n < 0) {
+            die("read source");
+        }
+        if (n == 0) {
             break;
         }
+        used += (size_t)n;
+        if (used > UINT32_MAX) {
+            fprintf(stderr, "Error: source file too large\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
+    *len = (uint32_t)used;
+    return buf;
+}
+
+/* Inode number of the regular file at path, or -1 after printing why not. */
+static uint32_t lookup_file(struct fs *fs, struct txn *txn, const char *filename) {
+    uint32_t parent;
+    char name[NAME_LEN];
+    if (path_parent(fs, txn, filename, &parent, name) < 0) {
+        return (uint32_t)-1;
+    }
+    uint32_t ino = dir_find(fs, txn, parent, name);
+    if (ino == (uint32_t)-1) {
+        fprintf(stderr, "Error: file '%s' not found\n", filename);
+        return (uint32_t)-1;
+    }
+    const struct inode *file = inode_read(fs, txn, ino);
+    if (file->type != INODE_FILE) {
+        fprintf(stderr, "Error: '%s' is not a regular file\n", filename);
+        return (uint32_t)-1;
+    }
+    if (!(file->flags & (INODE_FLAG_EXTENTS | INODE_FLAG_INLINE)) && file->size != 0) {
+        fprintf(stderr, "Error: '%s' uses the direct block map and cannot be written\n", filename);
+        return (uint32_t)-1;
+    }
+    return ino;
+}
+
+/*
+ * Pending contents of one file. Writes land in memory; blocks are only
+ * allocated when the buffer is mapped, sized to the final length, so
+ * several writes to a file cost one allocation and one inode update.
+ * data holds the file bytes [base, size), where base is block aligned
+ * and everything from base onwards is rewritten when the buffer is
+ * flushed.
+ */
+struct file_buf {
+    uint32_t ino;
+    uint32_t size;
+    uint32_t base;
+    uint8_t *data;
+    size_t capacity;
+};
+
+static void file_buf_reserve(struct file_buf *fb, size_t bytes) {
+    if (bytes <= fb->capacity) {
+        return;
+    }
+    size_t capacity = fb->capacity ? fb->capacity : BLOCK_SIZE;
+    while (capacity < bytes) {
+        capacity *= 2;
+    }
+    fb->data = realloc(fb->data, capacity);
+    if (!fb->data) {
+        die("realloc file buffer");
+    }
+    fb->capacity = capacity;
+}
+
+/*
+ * Removes the file at path. The inode loses a link; at zero links its
+ * blocks and inode are freed and the inode is zeroed. The directory's
+ * Bloom filter keeps the name's bits: they only cost false positives,
+ * and dir_add_entry rebuilds a filter once it saturates.
+ */
+static uint32_t fs_unlink(struct fs *fs, struct txn *txn, const char *filename) {
+    char name[NAME_LEN];
+    uint32_t parent;
+    if (path_parent(fs, txn, filename, &parent, name) < 0) {
+        return (uint32_t)-1;
+    }
+    const struct inode *dir = inode_read(fs, txn, parent);
+    uint32_t free_slot;
+    uint32_t slot = dir_lookup(fs, txn, dir, name, &free_slot);
+    if (slot == (uint32_t)-1) {
+        fprintf(stderr, "Error: file '%s' not found\n", filename);
+        return (uint32_t)-1;
+    }
+    uint32_t ino = dir_entry_read(fs, txn, dir, slot)->inode;
+    if (inode_read(fs, txn, ino)->type != INODE_FILE) {
+        fprintf(stderr, "Error: '%s' is not a regular file\n", filename);
+        return (uint32_t)-1;
+    }
+
+    if (dir->flags & INODE_FLAG_INDEX) {
+        dx_remove(fs, txn, dir, dx_hash(name), slot);
+    }
+    memset(dir_entry_write(fs, txn, dir, slot), 0, sizeof(struct dirent));
+    struct inode *wdir = inode_write(fs, txn, parent);
+    wdir->mtime = (uint32_t)time(NULL);
+    if (slot < wdir->free_hint) {
+        wdir->free_hint = slot;
+    }
+    if (fs->dcache) {
+        dcache_remove(fs->dcache, parent, name);
+    }
+
+    struct inode *file = inode_write(fs, txn, ino);
+    if (--file->links == 0) {
+        inode_free_blocks(fs, txn, file);
+        memset(file, 0, sizeof(*file));
+        fs_free_inode(fs, txn, ino);
+    }
+    return ino;
+}
+
+/* Reads the on-image contents of file blocks [first, last) into dst. */
+static void file_read_blocks(struct fs *fs, struct txn *txn, const struct inode *file,
+                             uint32_t first, uint32_t last, uint8_t *dst) {
+    if (file->flags & INODE_FLAG_INLINE) {
+        memset(dst, 0, (size_t)(last - first) * BLOCK_SIZE);
+        if (first == 0 && last > 0) {
+            inline_data_read(file, dst);
+        }
+        return;
+    }
+    uint32_t mapped = (file->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (uint32_t lblk = first; lblk < last; lblk++) {
+        uint8_t *block = dst + (size_t)(lblk - first) * BLOCK_SIZE;
+        uint64_t pblk = lblk < mapped ? inode_bmap(fs, txn, file, lblk) : 0;
+        if (pblk != 0) {
+            read_block(fs->fd, pblk, block);
+        } else {
+            memset(block, 0, BLOCK_SIZE);
+        }
+    }
+}
+
+static void file_buf_init(struct fs *fs, struct txn *txn, struct file_buf *fb, uint32_t ino) {
+    const struct inode *file = inode_read(fs, txn, ino);
+    memset(fb, 0, sizeof(*fb));
+    fb->ino = ino;
+    fb->size = file->size;
+    fb->base = file->size / BLOCK_SIZE * BLOCK_SIZE;
+    file_buf_reserve(fb, BLOCK_SIZE);
+    if (fb->size > fb->base) {
+        file_read_blocks(fs, txn, file, fb->base / BLOCK_SIZE, fb->base / BLOCK_SIZE + 1, fb->data);
+    }
+}
+
+static void file_buf_release(struct file_buf *fb) {
+    free(fb->data);
+    fb->data = NULL;
+    fb->capacity = 0;
+}
+
+static void file_buf_write(struct fs *fs, struct txn *txn, struct file_buf *fb,
+                           uint32_t offset, const uint8_t *src, uint32_t len) {
+    uint32_t new_base = offset / BLOCK_SIZE * BLOCK_SIZE;
+    if (new_base < fb->base) {
+        uint32_t extra = fb->base - new_base;
+        file_buf_reserve(fb, (size_t)(fb->size - fb->base) + extra);
+        memmove(fb->data + extra, fb->data, fb->size - fb->base);
+        file_read_blocks(fs, txn, inode_read(fs, txn, fb->ino),
+                         new_base / BLOCK_SIZE, fb->base / BLOCK_SIZE, fb->data);
+        fb->base = new_base;
+    }
+
+    uint32_t write_end = offset + len;
+    if (write_end > fb->size) {
+        file_buf_reserve(fb, write_end - fb->base);
+        memset(fb->data + (fb->size - fb->base), 0, write_end - fb->size);
+        fb->size = write_end;
+    }
+    memcpy(fb->data + (offset - fb->base), src, len);
+}
+
+/*
+ * Allocates blocks for the final size and updates the inode in txn.
+ * Files that stay within INLINE_DATA_MAX keep their data in the inode
+ * and need no data blocks; an inline file that outgrows it is moved to
+ * extents, and its bytes reach disk when the buffer is written out.
+ */
+static int file_buf_map(struct fs *fs, struct txn *txn, struct file_buf *fb) {
+    struct inode *file = inode_write(fs, txn, fb->ino);
+    int is_inline = (file->flags & INODE_FLAG_INLINE) != 0;
+    if (fb->size <= INLINE_DATA_MAX && (is_inline || file->size == 0)) {
+        file->size = fb->size;
+        file->mtime = (uint32_t)time(NULL);
+        inline_data_store(file, fb->data, fb->size);
+        return 0;
+    }
+    if (is_inline) {
+        memset(file->inline_tail, 0, sizeof(file->inline_tail));
+        file->flags &= ~INODE_FLAG_INLINE;
+        file->size = 0;
+    }
+    if (!(file->flags & INODE_FLAG_EXTENTS)) {
+        extent_init_root(file);
+    }
+    uint32_t old_blocks = (file->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t new_blocks = (fb->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint64_t goal = fs_data_goal(fs, fb->ino);
+    if (new_blocks > old_blocks && inode_grow(fs, txn, file, goal, old_blocks, new_blocks - old_blocks) < 0) {
+        return -1;
+    }
+    file->size = fb->size;
+    file->mtime = (uint32_t)time(NULL);
+    return 0;
+}
+
+/* Writes the buffered bytes to their home blocks, one pwrite per physical run. */
+static void file_buf_write_out(struct fs *fs, struct txn *txn, struct file_buf *fb) {
+    const struct inode *file = inode_read(fs, txn, fb->ino);
+    if (file->flags & INODE_FLAG_INLINE) {
+        return;
+    }
+    uint32_t first = fb->base / BLOCK_SIZE;
+    uint32_t last = (fb->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    size_t buffered = (size_t)(last - first) * BLOCK_SIZE;
+    file_buf_reserve(fb, buffered);
+    memset(fb->data + (fb->size - fb->base), 0, buffered - (fb->size - fb->base));
+
+    uint32_t lblk = first;
+    while (lblk < last) {
+        uint64_t pblk = inode_bmap(fs, txn, file, lblk);
+        uint32_t run = 1;
+        while (lblk + run < last && inode_bmap(fs, txn, file, lblk + run) == pblk + run) {
+            run++;
+        }
+        write_data_blocks(fs->fd, pblk, fb->data + (size_t)(lblk - first) * BLOCK_SIZE, run);
+        lblk += run;
+    }
+}
+
+static int parse_offset(const char *offset_str, uint32_t *offset) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(offset_str, &end, 10);
+    if (errno != 0 || *end != '\0' || offset_str[0] == '-' || value > UINT32_MAX) {
+        fprintf(stderr, "Error: invalid offset '%s'\n", offset_str);
+        return -1;
+    }
+    *offset = (uint32_t)value;
+    return 0;
+}
+
+/*
+ * Ordered-mode write: new blocks are allocated and the file data is
+ * written to its home blocks and flushed before the transaction carrying
+ * the inode size, extent map and bitmaps is committed. Data never enters
+ * the journal, and a crash before the commit leaves the old metadata
+ * pointing only at blocks it already owned.
+ */
+static void cmd_write(const char *image_path, const char *filename, const char *offset_str, const char *src_path) {
+    uint32_t offset;
+    if (parse_offset(offset_str, &offset) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t len;
+    uint8_t *data = read_source_file(src_path, &len);
+    if ((uint64_t)offset + len > UINT32_MAX) {
+        fprintf(stderr, "Error: write would exceed the maximum file size\n");
+        free(data);
+        exit(EXIT_FAILURE);
+    }
+
+    struct fs fs;
+    fs_open(&fs, image_path);
+    struct txn txn = {0};
+
+    uint32_t ino = lookup_file(&fs, &txn, filename);
+    if (ino == (uint32_t)-1) {
+        free(data);
+        txn_free(&txn);
+        fs_close(&fs);
+        exit(EXIT_FAILURE);
+    }
+
+    struct file_buf fb;
+    file_buf_init(&fs, &txn, &fb, ino);
+    file_buf_write(&fs, &txn, &fb, offset, data, len);
+    free(data);
+
+    if (file_buf_map(&fs, &txn, &fb) < 0) {
+        file_buf_release(&fb);
+        txn_free(&txn);
+        fs_close(&fs);
+        exit(EXIT_FAILURE);
+    }
+    if (!txn_fits(&fs, &txn)) {
+        fprintf(stderr, "Error: insufficient journal space. Install journal!\n");
+        file_buf_release(&fb);
+        txn_free(&txn);
+        fs_close(&fs);
+        exit(EXIT_FAILURE);
+    }
+
+    file_buf_write_out(&fs, &txn, &fb);
+    file_buf_release(&fb);
+
+    if (fdatasync(fs.fd) < 0) {
+        die("fdatasync");
+    }
+
+    if (txn_commit(&fs, &txn) < 0) {
+        fprintf(stderr, "Error: insufficient journal space. Install journal!\n");
+        txn_free(&txn);
+        fs_close(&fs);
+        exit(EXIT_FAILURE);
+    }
+
+    txn_free(&txn);
+    fs_close(&fs);
+
+    printf("Wrote %u bytes to '%s'\n", len, filename);
+}
+
+/* Unlinks every named file in a single transaction; any error aborts them all. */
+static void cmd_rm(const char *image_path, char **names, int count) {
+    struct fs fs;
+    fs_open(&fs, image_path);
+    struct txn txn = {0};
+
+    for (int i = 0; i < count; i++) {
+        if (fs_unlink(&fs, &txn, names[i]) == (uint32_t)-1) {
+            txn_free(&txn);
+            fs_close(&fs);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (txn_commit(&fs, &txn) < 0) {
+        fprintf(stderr, "Error: insufficient journal space. Install journal!\n");
+        txn_free(&txn);
+        fs_close(&fs);
+        exit(EXIT_FAILURE);
+    }
+
+    txn_free(&txn);
+    fs_close(&fs);
+
+    for (int i = 0; i < count; i++) {
+        printf("Removed '%s'\n", names[i]);
+    }
+}
 
+/*
+ * Rewrites the home descriptors of the groups covered by the bitmap
+ * blocks in the journal, counting from the bitmaps install just wrote.
+ * Until then those descriptors still match the bitmaps of the previous
+ * install, so a crash before the journal is cleared leaves them
+ * consistent and the next install redoes this.
+ */
+static void install_recount_groups(int fd, const struct superblock *sb, const uint8_t *journal_buf) {
+    const struct journal_header *jhdr = (const struct journal_header *)journal_buf;
+    uint32_t nbytes_used = jhdr->nbytes_used < journal_size(sb) ? jhdr->nbytes_used : journal_size(sb);
+    nbytes_used = journal_committed_end(journal_buf, sizeof(struct journal_header), nbytes_used);
+    uint32_t *blocks = malloc((nbytes_used / BLOCK_SIZE + 1) * sizeof(uint32_t));
+    uint32_t bitmap_blocks = 2;
+    uint8_t *bitmap = malloc(bitmap_blocks * (size_t)BLOCK_SIZE);
+    uint8_t *descs = malloc(BLOCK_SIZE);
+    if (!blocks || !bitmap || !descs) {
+        die("malloc group recount");
+    }
+    uint32_t nblocks = 0;
+    uint32_t offset = sizeof(struct journal_header);
+    uint32_t size;
+    while ((size = journal_record_size(journal_buf, offset, nbytes_used)) != 0) {
+        const struct rec_header *hdr = (const struct rec_header *)(journal_buf + offset);
         if (hdr->type == REC_DATA) {
-            offset += hdr->size;
+            int inodes;
+            uint32_t first, end;
+            bitmap_block_groups(sb, ((const struct data_record *)hdr)->block_no, &inodes, &first, &end);
+            if (first < end) {
+                blocks[nblocks++] = ((const struct data_record *)hdr)->block_no;
+            }
+        }
+        offset += size;
+    }
+    qsort(blocks, nblocks, sizeof(uint32_t), u32_cmp);
+
+    uint32_t desc_block = (uint32_t)-1;
+    for (uint32_t i = 0; i < nblocks; i++) {
+        if (i > 0 && blocks[i] == blocks[i - 1]) {
+            continue;
+        }
+        int inodes;
+        uint32_t first, end;
+        bitmap_block_groups(sb, blocks[i], &inodes, &first, &end);
+        uint32_t region = inodes ? sb->inode_bitmap : sb->data_bitmap;
+        for (uint32_t g = first; g < end; g++) {
+            if (g / GROUP_DESCS_PER_BLOCK != desc_block) {
+                if (desc_block != (uint32_t)-1) {
+                    write_block(fd, sb->group_desc + desc_block, descs);
+                }
+                desc_block = g / GROUP_DESCS_PER_BLOCK;
+                read_block(fd, sb->group_desc + desc_block, descs);
+            }
+            uint64_t lo, hi;
+            group_bits(sb, inodes, g, &lo, &hi);
+            uint64_t b = lo / BITS_PER_BLOCK;
+            uint64_t span = (hi - 1) / BITS_PER_BLOCK - b + 1;
+            if (span > bitmap_blocks) {
+                bitmap_blocks = (uint32_t)span;
+                bitmap = realloc(bitmap, bitmap_blocks * (size_t)BLOCK_SIZE);
+                if (!bitmap) {
+                    die("realloc group recount");
+                }
+            }
+            for (uint64_t j = 0; j < span; j++) {
+                read_block(fd, region + b + j, bitmap + j * BLOCK_SIZE);
+            }
+            uint32_t free_bits = bitmap_count_free(bitmap, lo - b * BITS_PER_BLOCK, hi - b * BITS_PER_BLOCK);
+            struct group_desc *gd = &((struct group_desc *)descs)[g % GROUP_DESCS_PER_BLOCK];
+            if (inodes) {
+                gd->free_inodes = free_bits;
+            } else {
+                gd->free_blocks = free_bits;
+            }
+        }
+    }
+    if (desc_block != (uint32_t)-1) {
+        write_block(fd, sb->group_desc + desc_block, descs);
+    }
+    free(blocks);
+    free(bitmap);
+    free(descs);
+}
+
+/*
+ * Copies every logged block of the committed transactions to its home
+ * location, then clears the journal. Replay stops at the last commit
+ * record or at the first malformed record, whichever comes first. The
+ * scan pass counts transactions and collects revoke records; the
+ * replay pass skips copies a later revoke cancelled.
+ */
+static int journal_replay(int fd, const struct superblock *sb, uint8_t *journal_buf) {
+    struct journal_header *jhdr = (struct journal_header *)journal_buf;
+    uint32_t offset = sizeof(struct journal_header);
+    uint32_t nbytes_used = jhdr->nbytes_used < journal_size(sb) ? jhdr->nbytes_used : journal_size(sb);
+    uint32_t committed = journal_committed_end(journal_buf, offset, nbytes_used);
+    uint32_t size;
+    if (committed < nbytes_used) {
+        fprintf(stderr, "Warning: ignoring %u byte(s) of the journal past the last commit\n", nbytes_used - committed);
+    }
+
+    int transactions_replayed = 0;
+    /* Each revoked block mapped to the last transaction that revoked it. */
+    struct block_map revokes = {0};
+
+    while ((size = journal_record_size(journal_buf, offset, committed)) != 0) {
+        struct rec_header *hdr = (struct rec_header *)(journal_buf + offset);
+        if (hdr->type == REC_REVOKE) {
+            struct revoke_record *rev = (struct revoke_record *)hdr;
+            for (uint32_t i = 0; i < rev->count; i++) {
+                block_map_set(&revokes, rev->blocks[i], (uint32_t)transactions_replayed);
+            }
         } else if (hdr->type == REC_COMMIT) {
             transactions_replayed++;
-            offset += hdr->size;
-        } else {
-            fprintf(stderr, "Warning: unknown record type %u at offset %u\n", hdr->type, offset);
-            break;
         }
+        offset += size;
     }
 
     offset = sizeof(struct journal_header);
-    while (offset < nbytes_used) {
+    uint32_t tid = 0;
+    while ((size = journal_record_size(journal_buf, offset, committed)) != 0) {
         struct rec_header *hdr = (struct rec_header *)(journal_buf + offset);
-        
-        if (offset + sizeof(struct rec_header) > nbytes_used) {
-            break;
-        }
-
         if (hdr->type == REC_DATA) {
-            struct data_record *data_rec = (struct data_record *)(journal_buf + offset);
-            write_block(fd, data_rec->block_no, data_rec->data);
-            offset += hdr->size;
+            struct data_record *data_rec = (struct data_record *)hdr;
+            uint32_t revoked_tid;
+            if (!block_map_get(&revokes, data_rec->block_no, &revoked_tid) || revoked_tid < tid) {
+                write_block(fd, data_rec->block_no, data_rec->data);
+            }
         } else if (hdr->type == REC_COMMIT) {
-            offset += hdr->size;
-        } else {
-            break;
+            tid++;
         }
+        offset += size;
+    }
+
+    block_map_free(&revokes);
+    install_recount_groups(fd, sb, journal_buf);
+
+    /* Like the descriptors, the cursors are rewritten in place and redone if the journal survives a crash. */
+    uint8_t *sb_block = malloc(BLOCK_SIZE);
+    if (!sb_block) {
+        die("malloc superblock");
+    }
+    read_block(fd, 0, sb_block);
+    if (journal_cursors(journal_buf, sizeof(struct journal_header), committed, (struct superblock *)sb_block)) {
+        write_block(fd, 0, sb_block);
     }
+    free(sb_block);
 
+    /* Punching the records drops the only other copy, so the installed blocks must be on disk first. */
+    if ((sb->features & FEATURE_DISCARD) && fdatasync(fd) < 0) {
+        die("fdatasync");
+    }
     init_journal(journal_buf);
-    write_journal(fd, journal_buf);
+    write_journal(fd, sb, journal_buf, 0);
+    if (sb->features & FEATURE_DISCARD) {
+        punch_blocks(fd, sb->journal_block + 1, sb->journal_blocks - 1);
+    }
+
+    return transactions_replayed;
+}
+
+static void cmd_install(const char *image_path) {
+    int fd = open(image_path, O_RDWR);
+    if (fd < 0) {
+        die("open");
+    }
+
+    struct superblock disk_sb;
+    if (read_superblock(fd, &disk_sb) < 0) {
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    const struct superblock *sb = &disk_sb;
+
+    uint8_t *journal_buf = malloc(journal_size(sb));
+    if (!journal_buf) {
+        die("malloc journal");
+    }
+    read_journal(fd, sb, journal_buf);
+
+    if (!journal_is_initialized(journal_buf)) {
+        fprintf(stderr, "Error: journal does not exist or is not initialized\n");
+        free(journal_buf);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    int transactions_replayed = journal_replay(fd, sb, journal_buf);
 
     free(journal_buf);
     close(fd);
@@ -381,9 +3309,211 @@ static void cmd_install(const char *image_path) {
     printf("Installed %d transaction(s) and cleared journal.\n", transactions_replayed);
 }
 
+/*
+ * Long-running mode: reads commands from stdin and keeps one open
+ * transaction. Writes stay in per-file buffers (delayed allocation) and
+ * blocks are only allocated at sync, once each file's final size is
+ * known, so a file written in many pieces still gets one contiguous
+ * allocation. A sync maps every buffer, writes and flushes the data,
+ * then commits the metadata; when the journal is full it is installed
+ * first. Any error abandons the open transaction.
+ */
+#define BATCH_LINE_MAX 1024
+
+struct batch {
+    struct fs fs;
+    struct txn txn;
+    struct file_buf *files;
+    uint32_t nfiles;
+    uint32_t capacity;
+    uint32_t pending;
+};
+
+static struct file_buf *batch_file(struct batch *b, uint32_t ino) {
+    for (uint32_t i = 0; i < b->nfiles; i++) {
+        if (b->files[i].ino == ino) {
+            return &b->files[i];
+        }
+    }
+    if (b->nfiles == b->capacity) {
+        b->capacity = b->capacity ? b->capacity * 2 : 16;
+        b->files = realloc(b->files, b->capacity * sizeof(*b->files));
+        if (!b->files) {
+            die("realloc batch files");
+        }
+    }
+    struct file_buf *fb = &b->files[b->nfiles++];
+    file_buf_init(&b->fs, &b->txn, fb, ino);
+    return fb;
+}
+
+static int batch_sync(struct batch *b) {
+    if (b->pending == 0) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < b->nfiles; i++) {
+        if (file_buf_map(&b->fs, &b->txn, &b->files[i]) < 0) {
+            return -1;
+        }
+    }
+
+    fs_flush_inodes(&b->fs, &b->txn);
+    if (!txn_fits(&b->fs, &b->txn)) {
+        int transactions = journal_replay(b->fs.fd, b->fs.sb, b->fs.journal_buf);
+        block_map_clear(&b->fs.journal_index);
+        printf("Installed %d transaction(s) and cleared journal.\n", transactions);
+        if (!txn_fits(&b->fs, &b->txn)) {
+            fprintf(stderr, "Error: transaction does not fit in the journal\n");
+            return -1;
+        }
+    }
+
+    for (uint32_t i = 0; i < b->nfiles; i++) {
+        file_buf_write_out(&b->fs, &b->txn, &b->files[i]);
+        file_buf_release(&b->files[i]);
+    }
+    if (b->nfiles > 0 && fdatasync(b->fs.fd) < 0) {
+        die("fdatasync");
+    }
+
+    if (txn_commit(&b->fs, &b->txn) < 0) {
+        fprintf(stderr, "Error: insufficient journal space. Install journal!\n");
+        return -1;
+    }
+
+    printf("Committed %u operation(s)\n", b->pending);
+    txn_free(&b->txn);
+    memset(&b->txn, 0, sizeof(b->txn));
+    b->nfiles = 0;
+    b->pending = 0;
+    return 0;
+}
+
+static int batch_rm(struct batch *b, const char *filename) {
+    uint32_t ino = fs_unlink(&b->fs, &b->txn, filename);
+    if (ino == (uint32_t)-1) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < b->nfiles; i++) {
+        if (b->files[i].ino == ino) {
+            file_buf_release(&b->files[i]);
+            b->files[i] = b->files[--b->nfiles];
+            break;
+        }
+    }
+    printf("Removed '%s'\n", filename);
+    return 0;
+}
+
+static int batch_write(struct batch *b, const char *filename, const char *offset_str, const char *src_path) {
+    uint32_t offset;
+    if (parse_offset(offset_str, &offset) < 0) {
+        return -1;
+    }
+
+    uint32_t ino = lookup_file(&b->fs, &b->txn, filename);
+    if (ino == (uint32_t)-1) {
+        return -1;
+    }
+
+    uint32_t len;
+    uint8_t *data = read_source_file(src_path, &len);
+    if ((uint64_t)offset + len > UINT32_MAX) {
+        fprintf(stderr, "Error: write would exceed the maximum file size\n");
+        free(data);
+        return -1;
+    }
+
+    file_buf_write(&b->fs, &b->txn, batch_file(b, ino), offset, data, len);
+    free(data);
+
+    printf("Wrote %u bytes to '%s'\n", len, filename);
+    return 0;
+}
+
+static uint32_t batch_dirty_blocks(const struct txn *txn) {
+    uint32_t dirty = 0;
+    for (uint32_t i = 0; i < txn->count; i++) {
+        dirty += txn->blocks[i].dirty;
+    }
+    return dirty;
+}
+
+static void cmd_batch(const char *image_path) {
+    struct batch b;
+    memset(&b, 0, sizeof(b));
+    fs_open(&b.fs, image_path);
+    b.fs.dcache = dcache_create();
+    b.fs.icache = icache_create();
+
+    char line[BATCH_LINE_MAX];
+    unsigned long lineno = 0;
+    int status = 0;
+    while (status == 0 && fgets(line, sizeof(line), stdin)) {
+        lineno++;
+        char *argv[5];
+        int argc = 0;
+        for (char *tok = strtok(line, " \t\r\n"); tok && argc < 5; tok = strtok(NULL, " \t\r\n")) {
+            argv[argc++] = tok;
+        }
+        if (argc == 0 || argv[0][0] == '#') {
+            continue;
+        }
+
+        if (strcmp(argv[0], "create") == 0 && argc == 2) {
+            status = fs_create(&b.fs, &b.txn, argv[1]);
+            if (status == 0) {
+                printf("Created file '%s'\n", argv[1]);
+            }
+        } else if (strcmp(argv[0], "write") == 0 && argc == 4) {
+            status = batch_write(&b, argv[1], argv[2], argv[3]);
+        } else if (strcmp(argv[0], "mkdir") == 0 && argc == 2) {
+            status = fs_mkdir(&b.fs, &b.txn, argv[1]);
+            if (status == 0) {
+                printf("Created directory '%s'\n", argv[1]);
+            }
+        } else if (strcmp(argv[0], "rm") == 0 && argc == 2) {
+            status = batch_rm(&b, argv[1]);
+        } else if (strcmp(argv[0], "sync") == 0 && argc == 1) {
+            status = batch_sync(&b);
+            continue;
+        } else {
+            fprintf(stderr, "Error: line %lu: unknown command\n", lineno);
+            status = -1;
+        }
+
+        if (status == 0) {
+            b.pending++;
+            fs_flush_inodes(&b.fs, &b.txn);
+            icache_trim(b.fs.icache);
+            if (batch_dirty_blocks(&b.txn) >= b.fs.sb->journal_blocks / 2) {
+                status = batch_sync(&b);
+            }
+        }
+    }
+
+    if (status == 0) {
+        status = batch_sync(&b);
+    }
+
+    for (uint32_t i = 0; i < b.nfiles; i++) {
+        file_buf_release(&b.files[i]);
+    }
+    free(b.files);
+    free(b.fs.dcache);
+    icache_free(b.fs.icache);
+    txn_free(&b.txn);
+    fs_close(&b.fs);
+
+    if (status < 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <create|install> [filename]\n", argv[0]);
+        fprintf(stderr, "Usage: %s <create|mkdir|write|rm|install|batch> [path...] [offset src]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -395,8 +3525,25 @@ int main(int argc, char *argv[]) {
             exit(EXIT_FAILURE);
         }
         cmd_create(image_path, argv[2]);
+    } else if (strcmp(command, "mkdir") == 0) {
+        if (argc < 3) {
+            exit(EXIT_FAILURE);
+        }
+        cmd_mkdir(image_path, argv[2]);
+    } else if (strcmp(command, "write") == 0) {
+        if (argc < 5) {
+            exit(EXIT_FAILURE);
+        }
+        cmd_write(image_path, argv[2], argv[3], argv[4]);
+    } else if (strcmp(command, "rm") == 0) {
+        if (argc < 3) {
+            exit(EXIT_FAILURE);
+        }
+        cmd_rm(image_path, &argv[2], argc - 2);
     } else if (strcmp(command, "install") == 0) {
         cmd_install(image_path);
+    } else if (strcmp(command, "batch") == 0) {
+        cmd_batch(image_path);
     } else {
         exit(EXIT_FAILURE);
     }
@@ -1,27 +1,74 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
 #define FS_MAGIC 0x56534653U
 
-#define BLOCK_SIZE        4096U
+#define MIN_BLOCK_SIZE     1024U
+#define MAX_BLOCK_SIZE    65536U
+#define BLOCK_SIZE        block_size
 #define INODE_SIZE         128U
+#define BITS_PER_BLOCK     (BLOCK_SIZE * 8U)
+#define INODES_PER_BLOCK   (BLOCK_SIZE / INODE_SIZE)
 #define JOURNAL_BLOCK_IDX    1U
-#define JOURNAL_BLOCKS      16U
-#define INODE_BLOCKS         2U
-#define DATA_BLOCKS         64U
-#define INODE_BMAP_IDX     (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
-#define DATA_BMAP_IDX      (INODE_BMAP_IDX + 1U)
-#define INODE_START_IDX    (DATA_BMAP_IDX + 1U)
-#define DATA_START_IDX     (INODE_START_IDX + INODE_BLOCKS)
-#define TOTAL_BLOCKS       (DATA_START_IDX + DATA_BLOCKS)
+#define DIRECT_POINTERS     8U
+#define NAME_LEN           28
 #define DEFAULT_IMAGE "vsfs.img"
 
+/* Geometry used when mkfs is given no options. */
+#define DEFAULT_BLOCK_SIZE   4096U
+#define DEFAULT_JOURNAL_BLOCKS 16U
+#define DEFAULT_INODES         64U
+#define DEFAULT_DATA_BLOCKS    64U
+#define MIN_JOURNAL_BLOCKS      4U
+
+#define GROUP_DESCS_PER_BLOCK  (BLOCK_SIZE / sizeof(struct group_desc))
+#define GROUP_INODE_UNINIT     0x1U
+
+#define FEATURE_64BIT          0x1U
+#define FEATURE_DISCARD        0x2U
+#define MAX_64BIT_BLOCKS       (1ULL << 48)
+
+#define INODE_FILE 1
+#define INODE_DIR  2
+
+#define INODE_FLAG_INDEX 0x1U
+#define INODE_FLAG_BLOOM 0x2U
+#define INODE_FLAG_EXTENTS 0x4U
+#define INODE_FLAG_INLINE  0x8U
+
+#define DIRENTS_PER_BLOCK  (BLOCK_SIZE / sizeof(struct dirent))
+
+#define DIR_BLOOM_BYTES    64U
+#define DIR_BLOOM_HASHES    3U
+#define INLINE_DATA_MAX    (DIRECT_POINTERS * 4 + 4 + DIR_BLOOM_BYTES)
+
+#define EXTENT_MAGIC      0xE47AU
+#define EXTENT_MAX_LEN    0xFFFFU
+#define EXTENT_ROOT_ENTRIES ((DIRECT_POINTERS * 4 - sizeof(struct extent_header)) / sizeof(struct extent))
+#define EXTENT_LEAF_ENTRIES ((BLOCK_SIZE - sizeof(struct extent_header)) / sizeof(struct extent))
+
+#define DX_ROOT_MAGIC 0x44585254U
+#define DX_LEAF_MAGIC 0x44584C46U
+#define DX_MIN_ENTRIES     64U
+#define DX_MAX_DEPTH       (BLOCK_SIZE >= 4096U ? 9U : BLOCK_SIZE >= 2048U ? 8U : 7U)
+#define DX_LEAF_ENTRIES    ((BLOCK_SIZE - 16) / sizeof(struct dx_entry))
+
+/* Blocks gathered into one pwrite by struct block_writer. */
+#define WRITE_CHUNK_BYTES (1U << 20)
+#define MAX_THREADS        64U
+
 struct superblock {
     uint32_t magic;
     uint32_t block_size;
@@ -34,7 +81,54 @@ struct superblock {
     uint32_t inode_start;
     uint32_t data_start;
 
-    uint8_t  _pad[128 - 9 * 4];
+    uint32_t journal_blocks;
+    uint32_t inode_bitmap_blocks;
+    uint32_t data_bitmap_blocks;
+    uint32_t data_blocks;
+
+    uint32_t group_count;
+    uint32_t inodes_per_group;
+    uint32_t blocks_per_group;
+    uint32_t group_desc;
+    uint32_t group_desc_blocks;
+
+    uint32_t features;
+    uint32_t total_blocks_hi;
+    uint32_t data_blocks_hi;
+
+    uint32_t next_inode;
+    uint32_t next_block;
+    uint32_t next_block_hi;
+
+    uint8_t  _pad[128 - 24 * 4];
+};
+
+struct group_desc {
+    uint32_t free_inodes;
+    uint32_t free_blocks;
+    uint32_t dirs;
+    uint32_t flags;
+};
+
+struct extent_header {
+    uint16_t magic;
+    uint16_t entries;
+    uint16_t max;
+    uint16_t depth;
+};
+
+struct extent {
+    uint32_t logical;
+    uint16_t len;
+    uint16_t start_hi;
+    uint32_t start;
+};
+
+struct extent_idx {
+    uint32_t logical;
+    uint32_t leaf;
+    uint16_t leaf_hi;
+    uint16_t unused;
 };
 
 struct inode {
@@ -42,32 +136,69 @@ struct inode {
     uint16_t links;
     uint32_t size;
 
-    uint32_t direct[8];
+    union {
+        uint32_t direct[DIRECT_POINTERS];
+        uint8_t extent_root[DIRECT_POINTERS * 4];
+    };
 
     uint32_t ctime;
     uint32_t mtime;
 
-    uint8_t _pad[128 - (2 + 2 + 4 + 8 * 4 + 4 + 4)];
+    uint32_t flags;
+    union {
+        struct {
+            uint32_t dx_root;
+            uint8_t bloom[DIR_BLOOM_BYTES];
+        };
+        uint8_t inline_tail[4 + DIR_BLOOM_BYTES];
+    };
+
+    /* Directories: every entry slot below this one is in use. */
+    uint32_t free_hint;
+
+    uint8_t _pad[128 - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4 + 4 + 4 + DIR_BLOOM_BYTES + 4)];
 };
 
 struct dirent {
     uint32_t inode;
-    char name[28];
+    char name[NAME_LEN];
+};
+
+struct dx_root {
+    uint32_t magic;
+    uint32_t depth;
+    uint32_t leaves[];
+};
+
+struct dx_entry {
+    uint32_t hash;
+    uint32_t slot;
+};
+
+struct dx_leaf {
+    uint32_t magic;
+    uint32_t depth;
+    uint32_t count;
+    uint32_t reserved;
+    struct dx_entry entries[];
 };
 
 _Static_assert(sizeof(struct superblock) == 128, "superblock must be 128 bytes");
 _Static_assert(sizeof(struct inode) == 128, "inode must be 128 bytes");
 _Static_assert(sizeof(struct dirent) == 32, "dirent must be 32 bytes");
+_Static_assert(sizeof(struct extent) == 12 && sizeof(struct extent_idx) == 12, "extent entries must be 12 bytes");
+
+static uint32_t block_size = DEFAULT_BLOCK_SIZE;
 
 static void die(const char *msg) {
     perror(msg);
     exit(EXIT_FAILURE);
 }
 
-static void write_block(int fd, const void *block) {
-    ssize_t written = write(fd, block, BLOCK_SIZE);
+static void write_block(int fd, uint32_t block_index, const void *block) {
+    ssize_t written = pwrite(fd, block, BLOCK_SIZE, (off_t)block_index * BLOCK_SIZE);
     if (written != (ssize_t)BLOCK_SIZE) {
-        die("write");
+        die("pwrite");
     }
 }
 
@@ -75,82 +206,1283 @@ static void set_bitmap(uint8_t *bitmap, uint32_t index) {
     bitmap[index / 8] |= (uint8_t)(1U << (index % 8));
 }
 
-int main(int argc, char *argv[]) {
-    const char *image_path = (argc > 1) ? argv[1] : DEFAULT_IMAGE;
+static uint32_t dx_hash(const char *name) {
+    uint32_t hash = 2166136261U;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* Filter positions come from the FNV-1a name hash and a remix of it (double hashing). */
+static void bloom_positions(const char *name, uint32_t pos[DIR_BLOOM_HASHES]) {
+    uint32_t h1 = dx_hash(name);
+    uint32_t h2 = (h1 ^ (h1 >> 16)) * 0x85EBCA6BU;
+    h2 = (h2 ^ (h2 >> 13)) | 1U;
+    for (uint32_t i = 0; i < DIR_BLOOM_HASHES; i++) {
+        pos[i] = (h1 + i * h2) % (DIR_BLOOM_BYTES * 8);
+    }
+}
+
+static void bloom_add(uint8_t *bloom, const char *name) {
+    uint32_t pos[DIR_BLOOM_HASHES];
+    bloom_positions(name, pos);
+    for (uint32_t i = 0; i < DIR_BLOOM_HASHES; i++) {
+        set_bitmap(bloom, pos[i]);
+    }
+}
+
+static uint64_t parse_count(const char *arg, char opt, uint64_t max) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || arg[0] == '-' || value == 0 || value > max) {
+        fprintf(stderr, "mkfs: invalid value '%s' for -%c\n", arg, opt);
+        exit(EXIT_FAILURE);
+    }
+    return value;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-b block_size] [-N inodes] [-J journal_blocks] [-D data_blocks | -B total_blocks] "
+                    "[-G blocks_per_group] [-O 64bit] [-O discard] [-P] [-T threads] [-d dir | --manifest file] [image]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t div_round_up(uint64_t n, uint64_t d) {
+    return (n + d - 1) / d;
+}
+
+/*
+ * Sequential image writer. Blocks handed out by writer_block are
+ * gathered and written with one pwrite per WRITE_CHUNK_BYTES, so the
+ * metadata regions and loaded files go out as large sequential writes.
+ */
+struct block_writer {
+    int fd;
+    uint64_t first;
+    uint32_t count;
+    uint32_t capacity;
+    uint8_t *buf;
+};
+
+static void writer_init(struct block_writer *w, int fd, uint64_t first) {
+    w->fd = fd;
+    w->first = first;
+    w->count = 0;
+    w->capacity = WRITE_CHUNK_BYTES / BLOCK_SIZE;
+    w->buf = malloc((size_t)w->capacity * BLOCK_SIZE);
+    if (!w->buf) {
+        die("malloc write buffer");
+    }
+}
+
+static void writer_flush(struct block_writer *w) {
+    size_t len = (size_t)w->count * BLOCK_SIZE;
+    if (len > 0 && pwrite(w->fd, w->buf, len, (off_t)w->first * BLOCK_SIZE) != (ssize_t)len) {
+        die("pwrite");
+    }
+    w->first += w->count;
+    w->count = 0;
+}
+
+static void writer_free(struct block_writer *w) {
+    writer_flush(w);
+    free(w->buf);
+    w->buf = NULL;
+}
+
+/* Continues at block, leaving the blocks in between untouched. */
+static void writer_seek(struct block_writer *w, uint64_t block) {
+    writer_flush(w);
+    w->first = block;
+}
 
-    int fd = open(image_path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+/* Zero-filled buffer for the next block. */
+static uint8_t *writer_block(struct block_writer *w) {
+    if (w->count == w->capacity) {
+        writer_flush(w);
+    }
+    uint8_t *block = w->buf + (size_t)w->count++ * BLOCK_SIZE;
+    memset(block, 0, BLOCK_SIZE);
+    return block;
+}
+
+/* Appends len bytes of src from offset, zero-padding the last block. Returns -1 if src ends early. */
+static int writer_copy(struct block_writer *w, int src, uint64_t offset, uint64_t len) {
+    while (len > 0) {
+        if (w->count == w->capacity) {
+            writer_flush(w);
+        }
+        uint8_t *dst = w->buf + (size_t)w->count * BLOCK_SIZE;
+        size_t room = (size_t)(w->capacity - w->count) * BLOCK_SIZE;
+        size_t want = len < room ? (size_t)len : room;
+        size_t got = 0;
+        while (got < want) {
+            ssize_t n = pread(src, dst + got, want - got, (off_t)(offset + got));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                die("read");
+            }
+            if (n == 0) {
+                return -1;
+            }
+            got += (size_t)n;
+        }
+        uint32_t blocks = (uint32_t)div_round_up(want, BLOCK_SIZE);
+        memset(dst + want, 0, (size_t)blocks * BLOCK_SIZE - want);
+        w->count += blocks;
+        offset += want;
+        len -= want;
+    }
+    return 0;
+}
+
+/*
+ * Lays the regions out back to back for a data region of data_blocks:
+ * superblock, journal, inode bitmap, data bitmap, group descriptors,
+ * inode table, data. The data region is cut into groups of
+ * blocks_per_group blocks, and the inode count is rounded up so every
+ * group gets the same whole number of inode-table blocks. A group's
+ * inodes must fit in one bitmap block, so when there are more inodes
+ * than that per group the groups are made smaller until there are
+ * enough of them. Returns the total block count.
+ */
+static uint64_t layout_for(struct superblock *sb, uint32_t inodes, uint32_t journal_blocks,
+                           uint64_t data_blocks, uint32_t blocks_per_group) {
+    uint64_t min_groups = div_round_up(inodes, BITS_PER_BLOCK);
+    if (div_round_up(data_blocks, blocks_per_group) < min_groups) {
+        if (data_blocks < min_groups) {
+            fprintf(stderr, "mkfs: %u inodes need at least %llu data blocks\n", inodes,
+                    (unsigned long long)min_groups);
+            exit(EXIT_FAILURE);
+        }
+        blocks_per_group = (uint32_t)(data_blocks / min_groups);
+    }
+    uint64_t groups = div_round_up(data_blocks, blocks_per_group);
+    if (groups > UINT32_MAX) {
+        fprintf(stderr, "mkfs: too many block groups; use a larger block size\n");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t inodes_per_group = div_round_up(div_round_up(inodes, groups), INODES_PER_BLOCK) * INODES_PER_BLOCK;
+    uint64_t inode_count = inodes_per_group * groups;
+    if (inode_count > UINT32_MAX) {
+        fprintf(stderr, "mkfs: too many inodes\n");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t inode_blocks = inode_count / INODES_PER_BLOCK;
+
+    sb->inode_count = (uint32_t)inode_count;
+    sb->group_count = (uint32_t)groups;
+    sb->inodes_per_group = (uint32_t)inodes_per_group;
+    sb->blocks_per_group = blocks_per_group;
+    sb->journal_block = JOURNAL_BLOCK_IDX;
+    sb->journal_blocks = journal_blocks;
+    sb->inode_bitmap_blocks = (uint32_t)div_round_up(inode_count, BITS_PER_BLOCK);
+    sb->inode_bitmap = sb->journal_block + journal_blocks;
+    sb->data_blocks = (uint32_t)data_blocks;
+    sb->data_blocks_hi = (uint32_t)(data_blocks >> 32);
+    sb->data_bitmap_blocks = (uint32_t)div_round_up(data_blocks, BITS_PER_BLOCK);
+    sb->data_bitmap = sb->inode_bitmap + sb->inode_bitmap_blocks;
+    sb->group_desc_blocks = (uint32_t)div_round_up(groups, GROUP_DESCS_PER_BLOCK);
+    sb->group_desc = sb->data_bitmap + sb->data_bitmap_blocks;
+    sb->inode_start = sb->group_desc + sb->group_desc_blocks;
+    uint64_t data_start = (uint64_t)sb->inode_start + inode_blocks;
+    sb->data_start = (uint32_t)(data_start > UINT32_MAX ? UINT32_MAX : data_start);
+
+    return data_start + data_blocks;
+}
+
+/*
+ * With a total block count the data region takes whatever the metadata
+ * leaves. Metadata only grows with the data region, so start from the
+ * size that certainly fits and grow it while the next block still does.
+ * Without FEATURE_64BIT every block number must fit in 32 bits; with it
+ * only the metadata must, since just file data extents reach past 2^32.
+ */
+static void compute_layout(struct superblock *sb, uint32_t inodes, uint32_t journal_blocks,
+                           uint64_t data_blocks, uint64_t total_blocks, uint32_t blocks_per_group) {
+    if (total_blocks != 0) {
+        uint64_t metadata = layout_for(sb, inodes, journal_blocks, total_blocks, blocks_per_group) - total_blocks;
+        if (metadata >= total_blocks) {
+            fprintf(stderr, "mkfs: %llu blocks leave no room for data\n", (unsigned long long)total_blocks);
+            exit(EXIT_FAILURE);
+        }
+        data_blocks = total_blocks - metadata;
+        while (data_blocks < total_blocks &&
+               layout_for(sb, inodes, journal_blocks, data_blocks + 1, blocks_per_group) <= total_blocks) {
+            data_blocks++;
+        }
+    }
+    uint64_t total = layout_for(sb, inodes, journal_blocks, data_blocks, blocks_per_group);
+    if (!(sb->features & FEATURE_64BIT) && total > UINT32_MAX) {
+        fprintf(stderr, "mkfs: image would exceed %u blocks; use -O 64bit\n", UINT32_MAX);
+        exit(EXIT_FAILURE);
+    }
+    uint64_t max_total = (uint64_t)INT64_MAX / BLOCK_SIZE < MAX_64BIT_BLOCKS ? (uint64_t)INT64_MAX / BLOCK_SIZE
+                                                                             : MAX_64BIT_BLOCKS;
+    if (total > max_total) {
+        fprintf(stderr, "mkfs: image would exceed %llu blocks\n", (unsigned long long)max_total);
+        exit(EXIT_FAILURE);
+    }
+    if (sb->data_start >= UINT32_MAX) {
+        fprintf(stderr, "mkfs: metadata must fit below block %u\n", UINT32_MAX);
+        exit(EXIT_FAILURE);
+    }
+    sb->total_blocks = (uint32_t)total;
+    sb->total_blocks_hi = (uint32_t)(total >> 32);
+}
+
+/*
+ * Tree loaded by -d or --manifest, built in memory before anything is
+ * written. Node 0 is the root. layout_tree sorts every directory by name,
+ * numbers the inodes so each directory's entries are consecutive, and
+ * assigns each node its blocks.
+ */
+#define NODE_NONE ((uint32_t)-1)
+
+struct node {
+    char name[NAME_LEN];
+    uint16_t type;
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t nchildren;
+    uint32_t nsubdirs;
+    char *source;        /* host file with the contents; NULL for an empty file */
+    uint64_t size;
+
+    /* Set by layout_tree; blocks are indexes into the data region. */
+    uint32_t ino;
+    uint32_t dx_depth;
+    uint64_t meta;       /* directory blocks then index blocks, or an extent leaf */
+    uint64_t data;       /* first block of a file's contents */
+};
+
+struct tree {
+    struct node *nodes;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t dirs;
+    uint32_t files;
+    uint32_t *by_ino;
+
+    /* Open-addressing table of nodes keyed by (parent, name); NODE_NONE marks a free slot. */
+    uint32_t *names;
+    uint32_t names_capacity;
+    uint64_t meta_blocks;
+    uint64_t used_blocks;
+
+    /* Nodes owning metadata blocks, and files owning data blocks, in block order. */
+    uint32_t *meta_nodes;
+    uint32_t nmeta;
+    uint32_t *data_nodes;
+    uint32_t ndata;
+};
+
+static void tree_init(struct tree *t) {
+    memset(t, 0, sizeof(*t));
+    t->capacity = 64;
+    t->nodes = calloc(t->capacity, sizeof(struct node));
+    if (!t->nodes) {
+        die("malloc tree");
+    }
+    t->nodes[0].type = INODE_DIR;
+    t->nodes[0].first_child = NODE_NONE;
+    t->nodes[0].next_sibling = NODE_NONE;
+    t->count = 1;
+    t->names_capacity = 128;
+    t->names = malloc((size_t)t->names_capacity * sizeof(uint32_t));
+    if (!t->names) {
+        die("malloc tree");
+    }
+    memset(t->names, 0xff, (size_t)t->names_capacity * sizeof(uint32_t));
+}
+
+static void tree_free(struct tree *t) {
+    for (uint32_t i = 0; i < t->count; i++) {
+        free(t->nodes[i].source);
+    }
+    free(t->nodes);
+    free(t->names);
+    free(t->by_ino);
+    free(t->meta_nodes);
+    free(t->data_nodes);
+    memset(t, 0, sizeof(*t));
+}
+
+/* Slot of (dir, name) in t->names: the matching node's, or the free one ending its probe. */
+static uint32_t tree_name_slot(const struct tree *t, uint32_t dir, const char *name) {
+    uint32_t mask = t->names_capacity - 1;
+    uint32_t i = (dx_hash(name) ^ (dir * 2654435761U)) & mask;
+    for (;;) {
+        uint32_t n = t->names[i];
+        if (n == NODE_NONE || (t->nodes[n].parent == dir && strcmp(t->nodes[n].name, name) == 0)) {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static uint32_t tree_find(const struct tree *t, uint32_t dir, const char *name) {
+    return t->names[tree_name_slot(t, dir, name)];
+}
+
+/* Doubles the name table, rehashing every node but the root. */
+static void tree_grow_names(struct tree *t) {
+    free(t->names);
+    t->names_capacity *= 2;
+    t->names = malloc((size_t)t->names_capacity * sizeof(uint32_t));
+    if (!t->names) {
+        die("malloc tree");
+    }
+    memset(t->names, 0xff, (size_t)t->names_capacity * sizeof(uint32_t));
+    for (uint32_t n = 1; n < t->count; n++) {
+        t->names[tree_name_slot(t, t->nodes[n].parent, t->nodes[n].name)] = n;
+    }
+}
+
+/* Adds name under dir; origin names the source of the entry in error messages. */
+static uint32_t tree_add(struct tree *t, uint32_t dir, const char *name, uint16_t type, const char *origin) {
+    if (name[0] == '\0' || strlen(name) >= NAME_LEN || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        fprintf(stderr, "mkfs: %s: invalid name '%s' (at most %d bytes, not '.' or '..')\n", origin, name,
+                NAME_LEN - 1);
+        exit(EXIT_FAILURE);
+    }
+    if (tree_find(t, dir, name) != NODE_NONE) {
+        fprintf(stderr, "mkfs: %s: '%s' is listed twice\n", origin, name);
+        exit(EXIT_FAILURE);
+    }
+    if (t->count == 1U << 30) {
+        fprintf(stderr, "mkfs: %s: too many files\n", origin);
+        exit(EXIT_FAILURE);
+    }
+    if (t->count == t->capacity) {
+        t->capacity *= 2;
+        t->nodes = realloc(t->nodes, (size_t)t->capacity * sizeof(struct node));
+        if (!t->nodes) {
+            die("realloc tree");
+        }
+    }
+    uint32_t n = t->count++;
+    struct node *node = &t->nodes[n];
+    memset(node, 0, sizeof(*node));
+    strcpy(node->name, name);
+    node->type = type;
+    node->parent = dir;
+    node->first_child = NODE_NONE;
+    if (t->count > t->names_capacity / 2) {
+        tree_grow_names(t);
+    } else {
+        t->names[tree_name_slot(t, dir, name)] = n;
+    }
+    node->next_sibling = t->nodes[dir].first_child;
+    t->nodes[dir].first_child = n;
+    t->nodes[dir].nchildren++;
+    if (type == INODE_DIR) {
+        t->nodes[dir].nsubdirs++;
+        t->dirs++;
+    } else {
+        t->files++;
+    }
+    return n;
+}
+
+/* Adds a file holding the contents of the host file source, or an empty one if source is NULL. */
+static void tree_add_file(struct tree *t, uint32_t dir, const char *name, const char *source, const char *origin) {
+    uint32_t n = tree_add(t, dir, name, INODE_FILE, origin);
+    if (!source) {
+        return;
+    }
+    struct stat st;
+    if (stat(source, &st) < 0) {
+        fprintf(stderr, "mkfs: %s: cannot stat '%s': %s\n", origin, source, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "mkfs: %s: '%s' is not a regular file\n", origin, source);
+        exit(EXIT_FAILURE);
+    }
+    if ((uint64_t)st.st_size > UINT32_MAX) {
+        fprintf(stderr, "mkfs: %s: '%s' is 4 GiB or larger\n", origin, source);
+        exit(EXIT_FAILURE);
+    }
+    t->nodes[n].size = (uint64_t)st.st_size;
+    if (st.st_size > 0) {
+        t->nodes[n].source = strdup(source);
+        if (!t->nodes[n].source) {
+            die("strdup");
+        }
+    }
+}
+
+/* nftw passes no context to its callback, so the walk keeps it here. */
+static struct tree *walk_tree;
+static uint32_t *walk_dirs;    /* node of the directory being walked at each depth */
+static int walk_levels;
+
+static int walk_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    if (flag == FTW_DNR || flag == FTW_NS) {
+        fprintf(stderr, "mkfs: cannot read '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (ftw->level == 0) {
+        if (flag != FTW_D) {
+            fprintf(stderr, "mkfs: '%s' is not a directory\n", path);
+            exit(EXIT_FAILURE);
+        }
+        walk_dirs[0] = 0;
+        return 0;
+    }
+    if (ftw->level >= walk_levels) {
+        walk_levels *= 2;
+        walk_dirs = realloc(walk_dirs, (size_t)walk_levels * sizeof(uint32_t));
+        if (!walk_dirs) {
+            die("realloc");
+        }
+    }
+    uint32_t dir = walk_dirs[ftw->level - 1];
+    if (flag == FTW_D) {
+        walk_dirs[ftw->level] = tree_add(walk_tree, dir, path + ftw->base, INODE_DIR, path);
+    } else if (flag == FTW_F && S_ISREG(st->st_mode)) {
+        tree_add_file(walk_tree, dir, path + ftw->base, path, path);
+    } else {
+        fprintf(stderr, "mkfs: skipping '%s': not a regular file or directory\n", path);
+    }
+    return 0;
+}
+
+/* Loads the host directory tree under root; symlinks and special files are skipped. */
+static void tree_load_dir(struct tree *t, const char *root) {
+    walk_tree = t;
+    walk_levels = 64;
+    walk_dirs = malloc((size_t)walk_levels * sizeof(uint32_t));
+    if (!walk_dirs) {
+        die("malloc");
+    }
+    if (nftw(root, walk_entry, 64, FTW_PHYS) < 0) {
+        die(root);
+    }
+    free(walk_dirs);
+    walk_dirs = NULL;
+}
+
+/*
+ * Manifest lines are "path/" for a directory, "path" for an empty file
+ * or "path source" for a file with the contents of the host file source.
+ * Missing parent directories are created; blank lines and lines starting
+ * with '#' are skipped.
+ */
+static void tree_load_manifest(struct tree *t, const char *manifest) {
+    FILE *f = fopen(manifest, "r");
+    if (!f) {
+        die(manifest);
+    }
+    char *line = NULL;
+    size_t line_cap = 0;
+    unsigned line_no = 0;
+    while (getline(&line, &line_cap, f) != -1) {
+        line_no++;
+        char origin[PATH_MAX + 32];
+        snprintf(origin, sizeof(origin), "%s:%u", manifest, line_no);
+
+        char *save;
+        char *path = strtok_r(line, " \t\r\n", &save);
+        if (!path || path[0] == '#') {
+            continue;
+        }
+        char *source = strtok_r(NULL, " \t\r\n", &save);
+        if (strtok_r(NULL, " \t\r\n", &save)) {
+            fprintf(stderr, "mkfs: %s: expected a path and at most one source\n", origin);
+            exit(EXIT_FAILURE);
+        }
+        int is_dir = path[strlen(path) - 1] == '/';
+        if (is_dir && source) {
+            fprintf(stderr, "mkfs: %s: a directory takes no source\n", origin);
+            exit(EXIT_FAILURE);
+        }
+
+        uint32_t dir = 0;
+        char *name_save;
+        char *name = strtok_r(path, "/", &name_save);
+        if (!name) {
+            fprintf(stderr, "mkfs: %s: empty path\n", origin);
+            exit(EXIT_FAILURE);
+        }
+        while (name) {
+            char *next = strtok_r(NULL, "/", &name_save);
+            uint32_t n = tree_find(t, dir, name);
+            if (!next && !is_dir) {
+                tree_add_file(t, dir, name, source, origin);
+            } else if (n == NODE_NONE) {
+                dir = tree_add(t, dir, name, INODE_DIR, origin);
+            } else if (t->nodes[n].type != INODE_DIR) {
+                fprintf(stderr, "mkfs: %s: '%s' is not a directory\n", origin, name);
+                exit(EXIT_FAILURE);
+            } else {
+                dir = n;
+            }
+            name = next;
+        }
+    }
+    free(line);
+    fclose(f);
+}
+
+static uint32_t dir_entries(const struct node *n) {
+    return n->nchildren + 2;
+}
+
+static uint32_t dir_blocks(const struct node *n) {
+    return (uint32_t)div_round_up(dir_entries(n), DIRENTS_PER_BLOCK);
+}
+
+static int dir_indexed(const struct node *n) {
+    return dir_entries(n) > DX_MIN_ENTRIES;
+}
+
+static int file_inline(const struct node *n) {
+    return n->size > 0 && n->size <= INLINE_DATA_MAX;
+}
+
+static uint64_t file_blocks(const struct node *n) {
+    return file_inline(n) ? 0 : div_round_up(n->size, BLOCK_SIZE);
+}
+
+static uint32_t file_extents(const struct node *n) {
+    return (uint32_t)div_round_up(file_blocks(n), EXTENT_MAX_LEN);
+}
+
+/* Directory blocks followed by the index root and leaves, or a file's extent leaf. */
+static uint32_t node_meta_blocks(const struct node *n) {
+    if (n->type == INODE_DIR) {
+        return dir_blocks(n) + (dir_indexed(n) ? 1 + (1U << n->dx_depth) : 0);
+    }
+    return file_extents(n) > EXTENT_ROOT_ENTRIES ? 1 : 0;
+}
+
+/* Name of entry slot of directory n, where child is the node in that slot (if any). */
+static const char *dir_slot_name(uint32_t slot, const struct node *child) {
+    return slot == 0 ? "." : slot == 1 ? ".." : child->name;
+}
+
+/* Smallest index depth at which no leaf gets more than DX_LEAF_ENTRIES of n's entries. */
+static uint32_t dx_depth_for(const struct tree *t, const struct node *n) {
+    static uint32_t counts[1U << 9];
+    for (uint32_t depth = 0; depth <= DX_MAX_DEPTH; depth++) {
+        uint32_t mask = (1U << depth) - 1;
+        uint32_t worst = 0;
+        memset(counts, 0, sizeof(counts));
+        uint32_t child = n->first_child;
+        for (uint32_t slot = 0; slot < dir_entries(n); slot++) {
+            const struct node *c = slot < 2 ? NULL : &t->nodes[child];
+            uint32_t bucket = dx_hash(dir_slot_name(slot, c)) & mask;
+            if (++counts[bucket] > worst) {
+                worst = counts[bucket];
+            }
+            if (c) {
+                child = c->next_sibling;
+            }
+        }
+        if (worst <= DX_LEAF_ENTRIES) {
+            return depth;
+        }
+    }
+    fprintf(stderr, "mkfs: directory '%s' does not fit its index\n", n->name);
+    exit(EXIT_FAILURE);
+}
+
+static const struct node *sort_nodes;
+
+static int node_name_cmp(const void *a, const void *b) {
+    return strcmp(sort_nodes[*(const uint32_t *)a].name, sort_nodes[*(const uint32_t *)b].name);
+}
+
+/* Sorts dir's entries by name and numbers them from *next_ino, then does the same below each subdirectory. */
+static void number_entries(struct tree *t, uint32_t dir, uint32_t *next_ino) {
+    uint32_t count = t->nodes[dir].nchildren;
+    if (count == 0) {
+        return;
+    }
+    uint32_t *children = malloc((size_t)count * sizeof(uint32_t));
+    if (!children) {
+        die("malloc");
+    }
+    uint32_t i = 0;
+    for (uint32_t n = t->nodes[dir].first_child; n != NODE_NONE; n = t->nodes[n].next_sibling) {
+        children[i++] = n;
+    }
+    sort_nodes = t->nodes;
+    qsort(children, count, sizeof(uint32_t), node_name_cmp);
+
+    t->nodes[dir].first_child = children[0];
+    for (i = 0; i < count; i++) {
+        struct node *n = &t->nodes[children[i]];
+        n->next_sibling = i + 1 < count ? children[i + 1] : NODE_NONE;
+        n->ino = (*next_ino)++;
+        t->by_ino[n->ino] = children[i];
+    }
+    for (i = 0; i < count; i++) {
+        if (t->nodes[children[i]].type == INODE_DIR) {
+            number_entries(t, children[i], next_ino);
+        }
+    }
+    free(children);
+}
+
+/*
+ * Numbers the inodes and places every block in the data region: first
+ * the metadata in inode order (directory blocks followed by their index,
+ * extent leaves of files with too many extents for the inode), then the
+ * contents of each file in inode order. Root's directory block comes
+ * first, as in an empty image.
+ */
+static void layout_tree(struct tree *t) {
+    t->by_ino = malloc((size_t)t->count * sizeof(uint32_t));
+    t->meta_nodes = malloc((size_t)t->count * sizeof(uint32_t));
+    t->data_nodes = malloc((size_t)t->count * sizeof(uint32_t));
+    if (!t->by_ino || !t->meta_nodes || !t->data_nodes) {
+        die("malloc");
+    }
+    t->by_ino[0] = 0;
+    uint32_t next_ino = 1;
+    number_entries(t, 0, &next_ino);
+
+    uint64_t block = 0;
+    for (uint32_t ino = 0; ino < t->count; ino++) {
+        struct node *n = &t->nodes[t->by_ino[ino]];
+        if (n->type == INODE_DIR && dir_indexed(n)) {
+            n->dx_depth = dx_depth_for(t, n);
+        }
+        if (node_meta_blocks(n) > 0) {
+            n->meta = block;
+            block += node_meta_blocks(n);
+            t->meta_nodes[t->nmeta++] = t->by_ino[ino];
+        }
+    }
+    t->meta_blocks = block;
+    for (uint32_t ino = 0; ino < t->count; ino++) {
+        struct node *n = &t->nodes[t->by_ino[ino]];
+        if (n->type == INODE_FILE && file_blocks(n) > 0) {
+            n->data = block;
+            block += file_blocks(n);
+            t->data_nodes[t->ndata++] = t->by_ino[ino];
+        }
+    }
+    t->used_blocks = block;
+}
+
+/* Bitmap blocks [first, end) of a bitmap at start with bits [0, used) set. */
+static void write_prefix_bitmap(struct block_writer *w, uint32_t start, uint32_t first, uint32_t end,
+                                uint64_t used) {
+    writer_seek(w, start + first);
+    for (uint32_t b = first; b < end; b++) {
+        uint8_t *block = writer_block(w);
+        uint64_t first_bit = (uint64_t)b * BITS_PER_BLOCK;
+        if (used <= first_bit) {
+            continue;
+        }
+        uint64_t bits = used - first_bit < BITS_PER_BLOCK ? used - first_bit : BITS_PER_BLOCK;
+        memset(block, 0xFF, bits / 8);
+        if (bits % 8) {
+            block[bits / 8] = (uint8_t)((1U << (bits % 8)) - 1);
+        }
+    }
+}
+
+/* Group descriptor blocks [first, end). Groups without a loaded inode keep their inode table uninitialized. */
+static void write_group_descs(struct block_writer *w, const struct superblock *sb, const struct tree *t,
+                              uint64_t data_blocks, uint32_t first, uint32_t end) {
+    writer_seek(w, sb->group_desc + first);
+    for (uint32_t b = first; b < end; b++) {
+        struct group_desc *descs = (struct group_desc *)writer_block(w);
+        for (uint32_t i = 0; i < GROUP_DESCS_PER_BLOCK && b * GROUP_DESCS_PER_BLOCK + i < sb->group_count; i++) {
+            uint32_t g = b * GROUP_DESCS_PER_BLOCK + i;
+            uint64_t first_block = (uint64_t)g * sb->blocks_per_group;
+            uint64_t len = data_blocks - first_block < sb->blocks_per_group ? data_blocks - first_block
+                                                                            : sb->blocks_per_group;
+            uint64_t used = t->used_blocks > first_block ? t->used_blocks - first_block : 0;
+            descs[i].free_blocks = (uint32_t)(used < len ? len - used : 0);
+
+            uint64_t first_ino = (uint64_t)g * sb->inodes_per_group;
+            uint64_t end_ino = first_ino + sb->inodes_per_group < t->count ? first_ino + sb->inodes_per_group
+                                                                            : t->count;
+            descs[i].free_inodes = sb->inodes_per_group;
+            if (first_ino >= t->count) {
+                descs[i].flags = GROUP_INODE_UNINIT;
+            }
+            for (uint64_t ino = first_ino; ino < end_ino; ino++) {
+                descs[i].free_inodes--;
+                if (t->nodes[t->by_ino[ino]].type == INODE_DIR) {
+                    descs[i].dirs++;
+                }
+            }
+        }
+    }
+}
+
+static void fill_extents(struct extent *ext, const struct superblock *sb, const struct node *n) {
+    uint64_t nblocks = file_blocks(n);
+    for (uint32_t e = 0; e < file_extents(n); e++) {
+        uint64_t logical = (uint64_t)e * EXTENT_MAX_LEN;
+        uint64_t start = sb->data_start + n->data + logical;
+        ext[e].logical = (uint32_t)logical;
+        ext[e].len = (uint16_t)(nblocks - logical < EXTENT_MAX_LEN ? nblocks - logical : EXTENT_MAX_LEN);
+        ext[e].start = (uint32_t)start;
+        ext[e].start_hi = (uint16_t)(start >> 32);
+    }
+}
+
+static int open_source(const struct node *n) {
+    int fd = open(n->source, O_RDONLY);
     if (fd < 0) {
-        die("open");
+        die(n->source);
     }
+    return fd;
+}
 
-    uint8_t block[BLOCK_SIZE];
-    memset(block, 0, sizeof(block));
+static void fill_inode(struct inode *inode, const struct superblock *sb, const struct tree *t,
+                       const struct node *n, uint32_t now) {
+    inode->type = n->type;
+    inode->ctime = now;
+    inode->mtime = now;
 
-    struct superblock sb = {
-        .magic = FS_MAGIC,
-        .block_size = BLOCK_SIZE,
-        .total_blocks = TOTAL_BLOCKS,
-        .inode_count = INODE_BLOCKS * (BLOCK_SIZE / INODE_SIZE),
-        .journal_block = JOURNAL_BLOCK_IDX,
-        .inode_bitmap = INODE_BMAP_IDX,
-        .data_bitmap = DATA_BMAP_IDX,
-        .inode_start = INODE_START_IDX,
-        .data_start = DATA_START_IDX,
-    };
+    if (n->type == INODE_DIR) {
+        inode->links = (uint16_t)(2 + n->nsubdirs);
+        inode->size = dir_entries(n) * (uint32_t)sizeof(struct dirent);
+        inode->free_hint = dir_entries(n);
+        /* The index caps a directory far below EXTENT_MAX_LEN blocks, so one extent maps them all. */
+        struct extent_header *root = (struct extent_header *)inode->extent_root;
+        struct extent *ext = (struct extent *)(root + 1);
+        root->magic = EXTENT_MAGIC;
+        root->max = EXTENT_ROOT_ENTRIES;
+        root->entries = 1;
+        ext->len = (uint16_t)dir_blocks(n);
+        ext->start = (uint32_t)(sb->data_start + n->meta);
+        inode->flags = INODE_FLAG_EXTENTS;
+        /* Indexed directories go without a Bloom filter, as in journal. */
+        if (dir_indexed(n)) {
+            inode->flags |= INODE_FLAG_INDEX;
+            inode->dx_root = (uint32_t)(sb->data_start + n->meta + dir_blocks(n));
+            return;
+        }
+        inode->flags |= INODE_FLAG_BLOOM;
+        bloom_add(inode->bloom, ".");
+        bloom_add(inode->bloom, "..");
+        for (uint32_t c = n->first_child; c != NODE_NONE; c = t->nodes[c].next_sibling) {
+            bloom_add(inode->bloom, t->nodes[c].name);
+        }
+        return;
+    }
 
-    memcpy(block, &sb, sizeof(sb));
-    write_block(fd, block); // Superblock
+    inode->links = 1;
+    inode->size = (uint32_t)n->size;
+    if (file_inline(n)) {
+        uint8_t data[INLINE_DATA_MAX];
+        int fd = open_source(n);
+        ssize_t got = pread(fd, data, n->size, 0);
+        if (got != (ssize_t)n->size) {
+            fprintf(stderr, "mkfs: '%s' changed while loading\n", n->source);
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        uint32_t head = inode->size < sizeof(inode->direct) ? inode->size : sizeof(inode->direct);
+        memcpy(inode->direct, data, head);
+        memcpy(inode->inline_tail, data + head, inode->size - head);
+        inode->flags = INODE_FLAG_INLINE;
+        return;
+    }
 
-    memset(block, 0, sizeof(block));
-    for (uint32_t i = 0; i < JOURNAL_BLOCKS; ++i) {
-        write_block(fd, block); // Journal blocks
+    struct extent_header *root = (struct extent_header *)inode->extent_root;
+    root->magic = EXTENT_MAGIC;
+    root->max = EXTENT_ROOT_ENTRIES;
+    inode->flags = INODE_FLAG_EXTENTS;
+    if (file_extents(n) <= EXTENT_ROOT_ENTRIES) {
+        root->entries = (uint16_t)file_extents(n);
+        fill_extents((struct extent *)(root + 1), sb, n);
+    } else {
+        struct extent_idx *idx = (struct extent_idx *)(root + 1);
+        root->entries = 1;
+        root->depth = 1;
+        idx[0].leaf = (uint32_t)(sb->data_start + n->meta);
     }
+}
 
-    memset(block, 0, sizeof(block));
-    set_bitmap(block, 0); // Reserve inode 0 for root
-    write_block(fd, block); // Inode bitmap
+/*
+ * Inode-table blocks that mkfs writes: the slices of the block groups
+ * up to the one holding the last loaded inode. Every later group is
+ * flagged GROUP_INODE_UNINIT and zeroed by the allocator on first use.
+ */
+static uint32_t itable_init_blocks(const struct superblock *sb, const struct tree *t) {
+    uint32_t groups = (uint32_t)div_round_up(t->count, sb->inodes_per_group);
+    return groups * (sb->inodes_per_group / INODES_PER_BLOCK);
+}
 
-    memset(block, 0, sizeof(block));
-    set_bitmap(block, 0); // Reserve first data block for root directory
-    write_block(fd, block); // Data bitmap
+/* Inode-table blocks [first, end). */
+static void write_inode_blocks(struct block_writer *w, const struct superblock *sb, const struct tree *t,
+                               uint32_t first, uint32_t end, uint32_t now) {
+    writer_seek(w, sb->inode_start + first);
+    for (uint32_t b = first; b < end; b++) {
+        struct inode *inodes = (struct inode *)writer_block(w);
+        for (uint32_t i = 0; i < INODES_PER_BLOCK && (uint64_t)b * INODES_PER_BLOCK + i < t->count; i++) {
+            fill_inode(&inodes[i], sb, t, &t->nodes[t->by_ino[b * INODES_PER_BLOCK + i]], now);
+        }
+    }
+}
 
-    time_t now = time(NULL);
+/* Block k of n's metadata: a directory block, the index root or an index leaf, or an extent leaf. */
+static void build_meta_block(uint8_t *block, const struct superblock *sb, const struct tree *t,
+                             const struct node *n, uint32_t k) {
+    if (n->type == INODE_FILE) {
+        struct extent_header *leaf = (struct extent_header *)block;
+        leaf->magic = EXTENT_MAGIC;
+        leaf->max = EXTENT_LEAF_ENTRIES;
+        leaf->entries = (uint16_t)file_extents(n);
+        fill_extents((struct extent *)(leaf + 1), sb, n);
+        return;
+    }
 
-    struct inode root = {0};
-    root.type = 2; // directory
-    root.links = 2; // "." and ".."
-    root.size = 2 * sizeof(struct dirent);
-    memset(root.direct, 0, sizeof(root.direct));
-    root.direct[0] = DATA_START_IDX;
-    root.ctime = (uint32_t)now;
-    root.mtime = (uint32_t)now;
+    uint32_t child = n->first_child;
+    if (k < dir_blocks(n)) {
+        struct dirent *entries = (struct dirent *)block;
+        uint32_t first = k * DIRENTS_PER_BLOCK;
+        uint32_t end = first + DIRENTS_PER_BLOCK < dir_entries(n) ? first + DIRENTS_PER_BLOCK : dir_entries(n);
+        for (uint32_t slot = 2; slot < first; slot++) {
+            child = t->nodes[child].next_sibling;
+        }
+        for (uint32_t slot = first; slot < end; slot++) {
+            struct dirent *de = &entries[slot - first];
+            const struct node *c = slot < 2 ? NULL : &t->nodes[child];
+            de->inode = slot == 0 ? n->ino : slot == 1 ? t->nodes[n->parent].ino : c->ino;
+            strcpy(de->name, dir_slot_name(slot, c));
+            if (c) {
+                child = c->next_sibling;
+            }
+        }
+        return;
+    }
 
-    memset(block, 0, sizeof(block));
-    memcpy(block, &root, sizeof(root));
-    write_block(fd, block); // First inode block
+    uint32_t first_leaf = (uint32_t)(sb->data_start + n->meta + dir_blocks(n) + 1);
+    if (k == dir_blocks(n)) {
+        struct dx_root *root = (struct dx_root *)block;
+        root->magic = DX_ROOT_MAGIC;
+        root->depth = n->dx_depth;
+        for (uint32_t i = 0; i < (1U << n->dx_depth); i++) {
+            root->leaves[i] = first_leaf + i;
+        }
+        return;
+    }
 
-    memset(block, 0, sizeof(block));
-    write_block(fd, block); // Second inode block
+    uint32_t bucket = k - dir_blocks(n) - 1;
+    struct dx_leaf *leaf = (struct dx_leaf *)block;
+    leaf->magic = DX_LEAF_MAGIC;
+    leaf->depth = n->dx_depth;
+    for (uint32_t slot = 0; slot < dir_entries(n); slot++) {
+        const struct node *c = slot < 2 ? NULL : &t->nodes[child];
+        uint32_t hash = dx_hash(dir_slot_name(slot, c));
+        if ((hash & ((1U << n->dx_depth) - 1)) == bucket) {
+            leaf->entries[leaf->count].hash = hash;
+            leaf->entries[leaf->count].slot = slot;
+            leaf->count++;
+        }
+        if (c) {
+            child = c->next_sibling;
+        }
+    }
+}
+
+/* Index into t->meta_nodes of the node owning metadata block block (or the first one after it). */
+static uint32_t first_meta_node(const struct tree *t, uint64_t block) {
+    uint32_t lo = 0, hi = t->nmeta;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const struct node *n = &t->nodes[t->meta_nodes[mid]];
+        if (n->meta + node_meta_blocks(n) <= block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Index into t->data_nodes of the file owning data block block. */
+static uint32_t first_data_node(const struct tree *t, uint64_t block) {
+    uint32_t lo = 0, hi = t->ndata;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const struct node *n = &t->nodes[t->data_nodes[mid]];
+        if (n->data + file_blocks(n) <= block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Data-region blocks [first, end), all of them in use by the tree. */
+static void write_data_blocks(struct block_writer *w, const struct superblock *sb, const struct tree *t,
+                              uint64_t first, uint64_t end) {
+    writer_seek(w, sb->data_start + first);
+    uint64_t block = first;
+    for (uint32_t i = first_meta_node(t, block); block < end && i < t->nmeta; i++) {
+        const struct node *n = &t->nodes[t->meta_nodes[i]];
+        for (uint32_t k = (uint32_t)(block - n->meta); k < node_meta_blocks(n) && block < end; k++, block++) {
+            build_meta_block(writer_block(w), sb, t, n, k);
+        }
+    }
+    for (uint32_t i = first_data_node(t, block); block < end; i++) {
+        const struct node *n = &t->nodes[t->data_nodes[i]];
+        uint64_t skip = block - n->data;
+        uint64_t count = file_blocks(n) - skip < end - block ? file_blocks(n) - skip : end - block;
+        uint64_t offset = skip * BLOCK_SIZE;
+        uint64_t len = n->size - offset < count * BLOCK_SIZE ? n->size - offset : count * BLOCK_SIZE;
+        int fd = open_source(n);
+        if (writer_copy(w, fd, offset, len) < 0) {
+            fprintf(stderr, "mkfs: '%s' changed while loading\n", n->source);
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        block += count;
+    }
+}
+
+/*
+ * The blocks mkfs writes, cut into jobs that touch disjoint blocks so
+ * worker threads can build and pwrite them in any order: chunks of the
+ * inode bitmap, data bitmap and group descriptors, then one job per block
+ * group with anything to write, covering that group's inode-table slice
+ * and its data blocks. The superblock is not part of any job; main
+ * writes it once the workers are done.
+ */
+struct format_jobs {
+    int fd;
+    const struct superblock *sb;
+    const struct tree *t;
+    uint64_t data_blocks;
+    uint32_t itable_blocks;
+    uint32_t now;
+
+    uint32_t chunk;             /* bitmap or descriptor blocks per job */
+    uint32_t inode_bitmap_jobs;
+    uint32_t data_bitmap_jobs;
+    uint32_t desc_jobs;
+    uint32_t group_jobs;
+
+    pthread_mutex_t lock;
+    uint32_t next;
+};
+
+static uint32_t format_jobs_total(const struct format_jobs *jobs) {
+    return jobs->inode_bitmap_jobs + jobs->data_bitmap_jobs + jobs->desc_jobs + jobs->group_jobs;
+}
+
+static void format_jobs_init(struct format_jobs *jobs, int fd, const struct superblock *sb,
+                             const struct tree *t, uint64_t data_blocks, uint32_t itable_blocks) {
+    memset(jobs, 0, sizeof(*jobs));
+    jobs->fd = fd;
+    jobs->sb = sb;
+    jobs->t = t;
+    jobs->data_blocks = data_blocks;
+    jobs->itable_blocks = itable_blocks;
+    jobs->now = (uint32_t)time(NULL);
+    jobs->chunk = WRITE_CHUNK_BYTES / BLOCK_SIZE;
+    jobs->inode_bitmap_jobs = (uint32_t)div_round_up(sb->inode_bitmap_blocks, jobs->chunk);
+    jobs->data_bitmap_jobs = (uint32_t)div_round_up(sb->data_bitmap_blocks, jobs->chunk);
+    jobs->desc_jobs = (uint32_t)div_round_up(sb->group_desc_blocks, jobs->chunk);
+
+    uint32_t group_itable_blocks = sb->inodes_per_group / INODES_PER_BLOCK;
+    uint64_t itable_groups = div_round_up(itable_blocks, group_itable_blocks);
+    uint64_t data_groups = div_round_up(t->used_blocks, sb->blocks_per_group);
+    jobs->group_jobs = (uint32_t)(itable_groups > data_groups ? itable_groups : data_groups);
+    pthread_mutex_init(&jobs->lock, NULL);
+}
+
+static void run_format_job(struct format_jobs *jobs, struct block_writer *w, uint32_t job) {
+    const struct superblock *sb = jobs->sb;
+    if (job < jobs->inode_bitmap_jobs) {
+        uint32_t first = job * jobs->chunk;
+        uint32_t end = first + jobs->chunk < sb->inode_bitmap_blocks ? first + jobs->chunk : sb->inode_bitmap_blocks;
+        write_prefix_bitmap(w, sb->inode_bitmap, first, end, jobs->t->count);
+        return;
+    }
+    job -= jobs->inode_bitmap_jobs;
+    if (job < jobs->data_bitmap_jobs) {
+        uint32_t first = job * jobs->chunk;
+        uint32_t end = first + jobs->chunk < sb->data_bitmap_blocks ? first + jobs->chunk : sb->data_bitmap_blocks;
+        write_prefix_bitmap(w, sb->data_bitmap, first, end, jobs->t->used_blocks);
+        return;
+    }
+    job -= jobs->data_bitmap_jobs;
+    if (job < jobs->desc_jobs) {
+        uint32_t first = job * jobs->chunk;
+        uint32_t end = first + jobs->chunk < sb->group_desc_blocks ? first + jobs->chunk : sb->group_desc_blocks;
+        write_group_descs(w, sb, jobs->t, jobs->data_blocks, first, end);
+        return;
+    }
+    job -= jobs->desc_jobs;
+
+    uint32_t group_itable_blocks = sb->inodes_per_group / INODES_PER_BLOCK;
+    uint64_t first = (uint64_t)job * group_itable_blocks;
+    uint64_t end = first + group_itable_blocks;
+    if (end > jobs->itable_blocks) {
+        end = jobs->itable_blocks;
+    }
+    if (first < end) {
+        write_inode_blocks(w, sb, jobs->t, (uint32_t)first, (uint32_t)end, jobs->now);
+    }
+    first = (uint64_t)job * sb->blocks_per_group;
+    end = first + sb->blocks_per_group;
+    if (end > jobs->t->used_blocks) {
+        end = jobs->t->used_blocks;
+    }
+    if (first < end) {
+        write_data_blocks(w, sb, jobs->t, first, end);
+    }
+    writer_flush(w);
+}
+
+static void *format_worker(void *arg) {
+    struct format_jobs *jobs = arg;
+    struct block_writer w;
+    writer_init(&w, jobs->fd, 0);
+    for (;;) {
+        pthread_mutex_lock(&jobs->lock);
+        uint32_t job = jobs->next++;
+        pthread_mutex_unlock(&jobs->lock);
+        if (job >= format_jobs_total(jobs)) {
+            break;
+        }
+        run_format_job(jobs, &w, job);
+    }
+    writer_free(&w);
+    return NULL;
+}
+
+/* Runs every job on up to threads threads; the calling thread is one of them. */
+static void run_format_jobs(struct format_jobs *jobs, uint32_t threads) {
+    if (threads > format_jobs_total(jobs)) {
+        threads = format_jobs_total(jobs);
+    }
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    if (!tids && threads > 0) {
+        die("malloc threads");
+    }
+    for (uint32_t i = 1; i < threads; i++) {
+        int err = pthread_create(&tids[i], NULL, format_worker, jobs);
+        if (err != 0) {
+            errno = err;
+            die("pthread_create");
+        }
+    }
+    format_worker(jobs);
+    for (uint32_t i = 1; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    pthread_mutex_destroy(&jobs->lock);
+}
 
+int main(int argc, char *argv[]) {
+    uint32_t inodes = DEFAULT_INODES;
+    uint32_t journal_blocks = DEFAULT_JOURNAL_BLOCKS;
+    uint64_t data_blocks = DEFAULT_DATA_BLOCKS;
+    uint64_t total_blocks = 0;
+    uint32_t blocks_per_group = 0;
+    uint32_t features = 0;
+    int preallocate = 0;
+    int inodes_given = 0;
+    int data_given = 0;
+    uint32_t threads = 0;
+    const char *source_dir = NULL;
+    const char *manifest = NULL;
+
+    static const struct option long_options[] = {
+        {"manifest", required_argument, NULL, 'm'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:N:J:D:B:G:O:PT:d:m:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            block_size = (uint32_t)parse_count(optarg, (char)opt, UINT32_MAX);
+            break;
+        case 'N':
+            inodes = (uint32_t)parse_count(optarg, (char)opt, UINT32_MAX);
+            inodes_given = 1;
+            break;
+        case 'J':
+            journal_blocks = (uint32_t)parse_count(optarg, (char)opt, UINT32_MAX);
+            break;
+        case 'D':
+            data_blocks = parse_count(optarg, (char)opt, MAX_64BIT_BLOCKS);
+            data_given = 1;
+            break;
+        case 'B':
+            total_blocks = parse_count(optarg, (char)opt, MAX_64BIT_BLOCKS);
+            data_given = 1;
+            break;
+        case 'G':
+            blocks_per_group = (uint32_t)parse_count(optarg, (char)opt, UINT32_MAX);
+            break;
+        case 'O':
+            if (strcmp(optarg, "64bit") == 0) {
+                features |= FEATURE_64BIT;
+            } else if (strcmp(optarg, "discard") == 0) {
+                features |= FEATURE_DISCARD;
+            } else {
+                fprintf(stderr, "mkfs: unknown feature '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'P':
+            preallocate = 1;
+            break;
+        case 'T':
+            threads = (uint32_t)parse_count(optarg, (char)opt, MAX_THREADS);
+            break;
+        case 'd':
+            source_dir = optarg;
+            break;
+        case 'm':
+            manifest = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind > 1) {
+        usage(argv[0]);
+    }
+    if (source_dir && manifest) {
+        fprintf(stderr, "mkfs: -d and --manifest cannot be combined\n");
+        exit(EXIT_FAILURE);
+    }
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+        fprintf(stderr, "mkfs: block size must be a power of two from %u to %u\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    if (inodes < 2) {
+        fprintf(stderr, "mkfs: need at least 2 inodes\n");
+        exit(EXIT_FAILURE);
+    }
+    if (journal_blocks < MIN_JOURNAL_BLOCKS) {
+        fprintf(stderr, "mkfs: journal needs at least %u blocks\n", MIN_JOURNAL_BLOCKS);
+        exit(EXIT_FAILURE);
+    }
+    if ((uint64_t)journal_blocks * BLOCK_SIZE > UINT32_MAX) {
+        fprintf(stderr, "mkfs: journal must be smaller than 4 GiB\n");
+        exit(EXIT_FAILURE);
+    }
+    if (blocks_per_group == 0) {
+        blocks_per_group = BITS_PER_BLOCK;
+    }
+    if (blocks_per_group > BITS_PER_BLOCK) {
+        fprintf(stderr, "mkfs: a group holds at most %u blocks\n", BITS_PER_BLOCK);
+        exit(EXIT_FAILURE);
+    }
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : (uint32_t)cpus;
+    }
+    const char *image_path = (optind < argc) ? argv[optind] : DEFAULT_IMAGE;
+
+    /* Without -d or --manifest the tree is just the root directory. */
+    struct tree tree;
+    tree_init(&tree);
+    if (source_dir) {
+        tree_load_dir(&tree, source_dir);
+    } else if (manifest) {
+        tree_load_manifest(&tree, manifest);
+    }
+    layout_tree(&tree);
+    /* A loaded image keeps the default free space on top of what the tree uses. */
+    if (source_dir || manifest) {
+        if (!inodes_given) {
+            inodes = tree.count + DEFAULT_INODES;
+        }
+        if (!data_given) {
+            data_blocks = tree.used_blocks + DEFAULT_DATA_BLOCKS;
+        }
+    }
+
+    struct superblock sb = {
+        .magic = FS_MAGIC,
+        .block_size = BLOCK_SIZE,
+        .features = features,
+    };
+    compute_layout(&sb, inodes, journal_blocks, data_blocks, total_blocks, blocks_per_group);
+    data_blocks = (uint64_t)sb.data_blocks_hi << 32 | sb.data_blocks;
+    total_blocks = (uint64_t)sb.total_blocks_hi << 32 | sb.total_blocks;
+    if (tree.count > sb.inode_count || tree.used_blocks > data_blocks) {
+        fprintf(stderr, "mkfs: the loaded tree needs %u inodes and %llu data blocks\n", tree.count,
+                (unsigned long long)tree.used_blocks);
+        exit(EXIT_FAILURE);
+    }
+    if ((uint64_t)sb.data_start + tree.meta_blocks > UINT32_MAX) {
+        fprintf(stderr, "mkfs: directories and extent leaves must fit below block %u\n", UINT32_MAX);
+        exit(EXIT_FAILURE);
+    }
+    sb.next_inode = tree.count < sb.inode_count ? tree.count : 0;
+    uint64_t next_block = tree.used_blocks < data_blocks ? tree.used_blocks : 0;
+    sb.next_block = (uint32_t)next_block;
+    sb.next_block_hi = (uint32_t)(next_block >> 32);
+
+    int fd = open(image_path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0) {
+        die("open");
+    }
+
+    /*
+     * Size the image first. It starts out all holes, even when an old
+     * image is reformatted, so only the blocks whose contents matter are
+     * written: the journal header, the bitmaps, the group descriptors,
+     * the inode-table groups holding the loaded inodes, and the
+     * directories and files themselves. Free data blocks are never read,
+     * and the other inode-table groups are zeroed by the transaction that
+     * first uses them. -P asks for the blocks to be reserved up front
+     * instead of left as holes.
+     */
+    off_t image_size = (off_t)total_blocks * BLOCK_SIZE;
+    if (ftruncate(fd, image_size) < 0) {
+        die("ftruncate");
+    }
+    if (preallocate) {
+        int err = posix_fallocate(fd, 0, image_size);
+        if (err != 0) {
+            errno = err;
+            die("posix_fallocate");
+        }
+    }
+
+    uint8_t block[BLOCK_SIZE];
     memset(block, 0, sizeof(block));
-    struct dirent *root_dirents = (struct dirent *)block;
-    root_dirents[0].inode = 0;
-    strncpy(root_dirents[0].name, ".", sizeof(root_dirents[0].name) - 1);
-    root_dirents[0].name[sizeof(root_dirents[0].name) - 1] = '\0';
-    root_dirents[1].inode = 0;
-    strncpy(root_dirents[1].name, "..", sizeof(root_dirents[1].name) - 1);
-    root_dirents[1].name[sizeof(root_dirents[1].name) - 1] = '\0';
-    write_block(fd, block); // First data block holds root directory entries
+    write_block(fd, sb.journal_block, block); // Journal header: not initialized
 
+    struct format_jobs jobs;
+    uint32_t itable_blocks = itable_init_blocks(&sb, &tree);
+    format_jobs_init(&jobs, fd, &sb, &tree, data_blocks, itable_blocks);
+    run_format_jobs(&jobs, threads);
+
+    /* The superblock goes last, once the image it describes is complete. */
     memset(block, 0, sizeof(block));
-    for (uint32_t i = 1; i < DATA_BLOCKS; ++i) {
-        write_block(fd, block);
-    }
+    memcpy(block, &sb, sizeof(sb));
+    write_block(fd, 0, block);
 
     if (close(fd) < 0) {
         die("close");
     }
 
-    printf("Created VSFS image '%s' (%u blocks).\n", image_path, TOTAL_BLOCKS);
+    printf("Created VSFS image '%s' (%llu blocks of %u bytes, %u inodes, %u journal blocks, %u groups).\n",
+           image_path, (unsigned long long)total_blocks, BLOCK_SIZE, sb.inode_count, sb.journal_blocks, sb.group_count);
+    if (source_dir || manifest) {
+        printf("Loaded %u directories and %u files (%llu data blocks).\n", tree.dirs, tree.files,
+               (unsigned long long)tree.used_blocks);
+    }
+    tree_free(&tree);
     return 0;
 }
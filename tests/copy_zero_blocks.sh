@@ -0,0 +1,17 @@
+#!/bin/sh
+# A file made of zero blocks must survive vsfs-copy as allocated data:
+# the validator treats an in-use data block that is a hole as lost.
+# Usage: tests/copy_zero_blocks.sh [directory holding the built tools]
+set -e
+root=$(cd "${1:-.}" && pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cd "$dir"
+head -c 16384 /dev/zero > zeros
+"$root/mkfs" -b 4096 >/dev/null
+"$root/journal" create zeros >/dev/null
+"$root/journal" write zeros 0 zeros >/dev/null
+"$root/journal" install >/dev/null
+"$root/vsfs-copy" vsfs.img copy.img >/dev/null
+"$root/validator" copy.img
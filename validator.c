@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
@@ -8,21 +9,44 @@
 #include <unistd.h>
 
 #define FS_MAGIC 0x56534653U
+#define JOURNAL_MAGIC 0x4A524E4CU
 
-#define BLOCK_SIZE        4096U
+#define MIN_BLOCK_SIZE     1024U
+#define MAX_BLOCK_SIZE    65536U
+#define BLOCK_SIZE        block_size
 #define INODE_SIZE         128U
+#define BITS_PER_BLOCK     (BLOCK_SIZE * 8U)
+#define INODES_PER_BLOCK   (BLOCK_SIZE / INODE_SIZE)
 #define JOURNAL_BLOCK_IDX    1U
-#define JOURNAL_BLOCKS      16U
-#define INODE_BLOCKS         2U
-#define DATA_BLOCKS         64U
-#define INODE_BMAP_IDX     (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
-#define DATA_BMAP_IDX      (INODE_BMAP_IDX + 1U)
-#define INODE_START_IDX    (DATA_BMAP_IDX + 1U)
-#define DATA_START_IDX     (INODE_START_IDX + INODE_BLOCKS)
-#define TOTAL_BLOCKS       (DATA_START_IDX + DATA_BLOCKS)
 #define DIRECT_POINTERS     8U
 #define DEFAULT_IMAGE "vsfs.img"
 
+#define INODE_FLAG_INDEX 0x1U
+#define INODE_FLAG_BLOOM 0x2U
+#define INODE_FLAG_EXTENTS 0x4U
+#define INODE_FLAG_INLINE  0x8U
+
+#define EXTENT_MAGIC      0xE47AU
+#define EXTENT_ROOT_ENTRIES ((DIRECT_POINTERS * 4 - sizeof(struct extent_header)) / sizeof(struct extent))
+#define EXTENT_LEAF_ENTRIES ((BLOCK_SIZE - sizeof(struct extent_header)) / sizeof(struct extent))
+
+#define DIR_BLOOM_BYTES    64U
+#define DIR_BLOOM_HASHES    3U
+#define INLINE_DATA_MAX    (DIRECT_POINTERS * 4 + 4 + DIR_BLOOM_BYTES)
+
+#define DX_ROOT_MAGIC 0x44585254U
+#define DX_LEAF_MAGIC 0x44584C46U
+#define DX_MAX_DEPTH       (BLOCK_SIZE >= 4096U ? 9U : BLOCK_SIZE >= 2048U ? 8U : 7U)
+#define DX_LEAF_ENTRIES    ((BLOCK_SIZE - 16) / sizeof(struct dx_entry))
+
+#define GROUP_DESCS_PER_BLOCK (BLOCK_SIZE / sizeof(struct group_desc))
+#define GROUP_INODE_UNINIT 0x1U
+
+#define FEATURE_64BIT      0x1U
+#define FEATURE_DISCARD    0x2U
+#define FEATURE_KNOWN      (FEATURE_64BIT | FEATURE_DISCARD)
+#define MAX_64BIT_BLOCKS   (1ULL << 48)
+
 struct superblock {
     uint32_t magic;
     uint32_t block_size;
@@ -35,7 +59,54 @@ struct superblock {
     uint32_t inode_start;
     uint32_t data_start;
 
-    uint8_t  _pad[128 - 9 * 4];
+    uint32_t journal_blocks;
+    uint32_t inode_bitmap_blocks;
+    uint32_t data_bitmap_blocks;
+    uint32_t data_blocks;
+
+    uint32_t group_count;
+    uint32_t inodes_per_group;
+    uint32_t blocks_per_group;
+    uint32_t group_desc;
+    uint32_t group_desc_blocks;
+
+    uint32_t features;
+    uint32_t total_blocks_hi;
+    uint32_t data_blocks_hi;
+
+    uint32_t next_inode;
+    uint32_t next_block;
+    uint32_t next_block_hi;
+
+    uint8_t  _pad[128 - 24 * 4];
+};
+
+struct group_desc {
+    uint32_t free_inodes;
+    uint32_t free_blocks;
+    uint32_t dirs;
+    uint32_t flags;
+};
+
+struct extent_header {
+    uint16_t magic;
+    uint16_t entries;
+    uint16_t max;
+    uint16_t depth;
+};
+
+struct extent {
+    uint32_t logical;
+    uint16_t len;
+    uint16_t start_hi;
+    uint32_t start;
+};
+
+struct extent_idx {
+    uint32_t logical;
+    uint32_t leaf;
+    uint16_t leaf_hi;
+    uint16_t unused;
 };
 
 struct inode {
@@ -43,12 +114,28 @@ struct inode {
     uint16_t links;
     uint32_t size;
 
-    uint32_t direct[DIRECT_POINTERS];
+    union {
+        uint32_t direct[DIRECT_POINTERS];
+        uint8_t extent_root[DIRECT_POINTERS * 4];
+    };
 
     uint32_t ctime;
     uint32_t mtime;
 
-    uint8_t _pad[128 - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4)];
+    uint32_t flags;
+
+    union {
+        struct {
+            uint32_t dx_root;
+            uint8_t bloom[DIR_BLOOM_BYTES];
+        };
+        uint8_t inline_tail[4 + DIR_BLOOM_BYTES];
+    };
+
+    /* Directories: every entry slot below this one is in use. */
+    uint32_t free_hint;
+
+    uint8_t _pad[128 - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4 + 4 + 4 + DIR_BLOOM_BYTES + 4)];
 };
 
 struct dirent {
@@ -56,17 +143,47 @@ struct dirent {
     char name[28];
 };
 
+struct journal_header {
+    uint32_t magic;
+    uint32_t nbytes_used;
+};
+
+struct dx_root {
+    uint32_t magic;
+    uint32_t depth;
+    uint32_t leaves[];
+};
+
+struct dx_entry {
+    uint32_t hash;
+    uint32_t slot;
+};
+
+struct dx_leaf {
+    uint32_t magic;
+    uint32_t depth;
+    uint32_t count;
+    uint32_t reserved;
+    struct dx_entry entries[];
+};
+
 _Static_assert(sizeof(struct superblock) == 128, "superblock must be 128 bytes");
 _Static_assert(sizeof(struct inode) == 128, "inode must be 128 bytes");
 _Static_assert(sizeof(struct dirent) == 32, "dirent must be 32 bytes");
-
+_Static_assert(sizeof(struct extent) == 12 && sizeof(struct extent_idx) == 12, "extent entries must be 12 bytes");
 static int error_count = 0;
 
+/* Block size of the image being checked, taken from its superblock. */
+static uint32_t block_size;
+
 static void die(const char *msg) {
     perror(msg);
     exit(EXIT_FAILURE);
 }
 
+/* Layout of the image being checked, taken from its superblock. */
+static struct superblock geo;
+
 static void report_error(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
@@ -77,160 +194,788 @@ static void report_error(const char *fmt, ...) {
     error_count++;
 }
 
+/*
+ * Allocated regions of the image file in blocks, found with SEEK_DATA
+ * and SEEK_HOLE. Everything else is a hole, which reads as zeros, so
+ * blocks in holes are never read. Where the host filesystem cannot
+ * report holes the whole file is one region.
+ */
+struct hole_map {
+    uint64_t *start;
+    uint64_t *end;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+static struct hole_map holes;
+
+static void hole_map_add(uint64_t start, uint64_t end) {
+    if (holes.count > 0 && start <= holes.end[holes.count - 1]) {
+        holes.end[holes.count - 1] = end;
+        return;
+    }
+    if (holes.count == holes.capacity) {
+        holes.capacity = holes.capacity ? holes.capacity * 2 : 64;
+        holes.start = realloc(holes.start, holes.capacity * sizeof(uint64_t));
+        holes.end = realloc(holes.end, holes.capacity * sizeof(uint64_t));
+        if (!holes.start || !holes.end) {
+            die("realloc hole map");
+        }
+    }
+    holes.start[holes.count] = start;
+    holes.end[holes.count] = end;
+    holes.count++;
+}
+
+static void hole_map_build(int fd, off_t image_size) {
+    off_t pos = 0;
+    while (pos < image_size) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) {
+            break;
+        }
+        if (data < 0) {
+            hole_map_add(0, ((uint64_t)image_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+            return;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            die("lseek");
+        }
+        hole_map_add((uint64_t)data / BLOCK_SIZE, ((uint64_t)hole + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        pos = hole;
+    }
+}
+
+static void hole_map_free(void) {
+    free(holes.start);
+    free(holes.end);
+    memset(&holes, 0, sizeof(holes));
+}
+
+/* Index of the first region ending after blk. */
+static uint32_t hole_map_find(uint64_t blk) {
+    uint32_t lo = 0, hi = holes.count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (holes.end[mid] <= blk) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Reads blocks [first, first + count); holes are zero-filled instead of read. */
+static void pread_blocks(int fd, uint64_t first, uint64_t count, uint8_t *buf) {
+    uint64_t end = first + count;
+    uint64_t blk = first;
+    for (uint32_t r = hole_map_find(first); blk < end; r++) {
+        uint64_t data = r < holes.count && holes.start[r] < end ? holes.start[r] : end;
+        if (data > blk) {
+            memset(buf + (blk - first) * BLOCK_SIZE, 0, (size_t)(data - blk) * BLOCK_SIZE);
+            blk = data;
+        }
+        uint64_t stop = r < holes.count && holes.end[r] < end ? holes.end[r] : end;
+        while (blk < stop) {
+            size_t len = (size_t)(stop - blk) * BLOCK_SIZE;
+            ssize_t n = pread(fd, buf + (blk - first) * BLOCK_SIZE, len < (1U << 30) ? len : (1U << 30),
+                              (off_t)(blk * BLOCK_SIZE));
+            if (n <= 0 || n % BLOCK_SIZE != 0) {
+                die("pread");
+            }
+            blk += (uint64_t)n / BLOCK_SIZE;
+        }
+    }
+}
+
 static void pread_block(int fd, uint32_t block_index, void *buf) {
+    pread_blocks(fd, block_index, 1, buf);
+}
+
+static void pwrite_block(int fd, uint32_t block_index, const void *buf) {
     off_t offset = (off_t)block_index * BLOCK_SIZE;
-    ssize_t n = pread(fd, buf, BLOCK_SIZE, offset);
+    ssize_t n = pwrite(fd, buf, BLOCK_SIZE, offset);
     if (n != (ssize_t)BLOCK_SIZE) {
-        die("pread");
+        die("pwrite");
     }
 }
 
-static int bitmap_test(const uint8_t *bitmap, uint32_t index) {
+static int bitmap_test(const uint8_t *bitmap, uint64_t index) {
     return (bitmap[index / 8] >> (index % 8)) & 0x1;
 }
 
-static void bitmap_check_zero_tail(const uint8_t *bitmap, uint32_t valid_bits, const char *name) {
-    uint32_t total_bits = BLOCK_SIZE * 8;
-    for (uint32_t bit = valid_bits; bit < total_bits; ++bit) {
+static void bitmap_set(uint8_t *bitmap, uint64_t index) {
+    bitmap[index / 8] |= (uint8_t)(1U << (index % 8));
+}
+
+static void bitmap_check_zero_tail(const uint8_t *bitmap, uint32_t bitmap_blocks, uint64_t valid_bits,
+                                   const char *name) {
+    uint64_t total_bits = (uint64_t)bitmap_blocks * BITS_PER_BLOCK;
+    for (uint64_t bit = valid_bits; bit < total_bits; ++bit) {
         if (bitmap_test(bitmap, bit)) {
-            report_error("%s bitmap has stray bit set at %u", name, bit);
+            report_error("%s bitmap has stray bit set at %llu", name, (unsigned long long)bit);
             return;
         }
     }
 }
 
-static void validate_superblock(const struct superblock *sb) {
+static uint32_t dx_hash(const char *name) {
+    uint32_t hash = 2166136261U;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void bloom_positions(const char *name, uint32_t pos[DIR_BLOOM_HASHES]) {
+    uint32_t h1 = dx_hash(name);
+    uint32_t h2 = (h1 ^ (h1 >> 16)) * 0x85EBCA6BU;
+    h2 = (h2 ^ (h2 >> 13)) | 1U;
+    for (uint32_t i = 0; i < DIR_BLOOM_HASHES; i++) {
+        pos[i] = (h1 + i * h2) % (DIR_BLOOM_BYTES * 8);
+    }
+}
+
+static void bloom_add(uint8_t *bloom, const char *name) {
+    uint32_t pos[DIR_BLOOM_HASHES];
+    bloom_positions(name, pos);
+    for (uint32_t i = 0; i < DIR_BLOOM_HASHES; i++) {
+        bitmap_set(bloom, pos[i]);
+    }
+}
+
+static uint64_t u64_join(uint32_t lo, uint32_t hi) {
+    return (uint64_t)hi << 32 | lo;
+}
+
+static uint64_t sb_data_blocks(const struct superblock *sb) {
+    return u64_join(sb->data_blocks, sb->data_blocks_hi);
+}
+
+/* Marks blk as referenced in the claimed bitmap (one bit per data block). */
+static int claim_data_block(uint8_t *claimed, uint64_t blk, uint32_t inode_index) {
+    if (blk < geo.data_start || blk - geo.data_start >= sb_data_blocks(&geo)) {
+        report_error("inode %u points outside data region (block %llu)", inode_index, (unsigned long long)blk);
+        return 0;
+    }
+    uint64_t data_idx = blk - geo.data_start;
+    if (bitmap_test(claimed, data_idx)) {
+        report_error("data block %llu referenced more than once (again by inode %u)",
+                     (unsigned long long)blk, inode_index);
+    }
+    bitmap_set(claimed, data_idx);
+    return 1;
+}
+
+static uint64_t blocks_for_bits(uint64_t bits) {
+    return (bits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+}
+
+/* Clear bits in [first, end), counted a 64-bit word at a time. */
+static uint64_t bitmap_count_clear(const uint8_t *bitmap, uint64_t first, uint64_t end) {
+    uint64_t count = 0;
+    while (first < end && first % 64 != 0) {
+        count += !bitmap_test(bitmap, first++);
+    }
+    for (; first + 64 <= end; first += 64) {
+        uint64_t word;
+        memcpy(&word, bitmap + first / 8, sizeof(word));
+        count += 64 - (uint64_t)__builtin_popcountll(word);
+    }
+    while (first < end) {
+        count += !bitmap_test(bitmap, first++);
+    }
+    return count;
+}
+
+/* First set bit in [first, end); end if there is none. */
+static uint64_t bitmap_find_set(const uint8_t *bitmap, uint64_t first, uint64_t end) {
+    while (first < end && !bitmap_test(bitmap, first)) {
+        first++;
+    }
+    return first;
+}
+
+/*
+ * Cross-checks the hole map against the data bitmap, one region at a
+ * time. mkfs and journal write every block they allocate, so an in-use
+ * block that is a hole has lost its contents. The exception is a
+ * journal still holding transactions: with FEATURE_DISCARD the blocks
+ * they free are punched before install clears their bitmap bits. Free
+ * blocks that still hold data are only counted; on a discard image they
+ * mean a punch did not happen.
+ */
+static void check_holes(const uint8_t *data_bitmap, int journal_pending) {
+    uint64_t data_blocks = sb_data_blocks(&geo);
+    uint64_t used_holes = 0, first_used_hole = 0, free_present = 0;
+    uint64_t pos = 0;
+    for (uint32_t r = hole_map_find(geo.data_start); pos < data_blocks; r++) {
+        uint64_t data = data_blocks;
+        if (r < holes.count) {
+            data = holes.start[r] > geo.data_start ? holes.start[r] - geo.data_start : 0;
+            data = data < data_blocks ? data : data_blocks;
+        }
+        uint64_t used = (data - pos) - bitmap_count_clear(data_bitmap, pos, data);
+        if (used > 0 && used_holes == 0) {
+            first_used_hole = bitmap_find_set(data_bitmap, pos, data);
+        }
+        used_holes += used;
+        if (r >= holes.count) {
+            break;
+        }
+        uint64_t stop = holes.end[r] - geo.data_start < data_blocks ? holes.end[r] - geo.data_start : data_blocks;
+        free_present += bitmap_count_clear(data_bitmap, data, stop);
+        pos = stop;
+    }
+    if (used_holes > 0 && !journal_pending) {
+        report_error("%llu in-use data blocks are holes in the image (first: block %llu)",
+                     (unsigned long long)used_holes, (unsigned long long)(first_used_hole + geo.data_start));
+    }
+    if (free_present > 0 && (geo.features & FEATURE_DISCARD)) {
+        printf("Note: %llu free data blocks are not punched out of the image\n", (unsigned long long)free_present);
+    }
+}
+
+/*
+ * The regions must follow each other exactly as mkfs lays them out.
+ * Returns 0 when the layout cannot be trusted, in which case nothing
+ * else is checked.
+ */
+static int validate_superblock(const struct superblock *sb, off_t image_size) {
+    int before = error_count;
     if (sb->magic != FS_MAGIC) {
         report_error("invalid superblock magic 0x%08x", sb->magic);
+        return 0;
     }
-    if (sb->block_size != BLOCK_SIZE) {
-        report_error("unexpected block size %u", sb->block_size);
+    if (sb->block_size < MIN_BLOCK_SIZE || sb->block_size > MAX_BLOCK_SIZE ||
+        (sb->block_size & (sb->block_size - 1)) != 0) {
+        report_error("unsupported block size %u", sb->block_size);
+        return 0;
     }
-    if (sb->total_blocks != TOTAL_BLOCKS) {
-        report_error("unexpected total blocks %u", sb->total_blocks);
+    block_size = sb->block_size;
+    if (sb->features & ~FEATURE_KNOWN) {
+        report_error("unsupported filesystem features 0x%x", sb->features);
+        return 0;
     }
-    uint32_t expected_inodes = INODE_BLOCKS * (BLOCK_SIZE / INODE_SIZE);
-    if (sb->inode_count != expected_inodes) {
-        report_error("unexpected inode count %u", sb->inode_count);
+    if (!(sb->features & FEATURE_64BIT) &&
+        (sb->total_blocks_hi | sb->data_blocks_hi | sb->next_block_hi) != 0) {
+        report_error("64-bit block counts set without the 64bit feature");
+    }
+    uint64_t data_blocks = sb_data_blocks(sb);
+    uint64_t total_blocks = u64_join(sb->total_blocks, sb->total_blocks_hi);
+    if (sb->inode_count == 0 || sb->inode_count % INODES_PER_BLOCK != 0) {
+        report_error("inode count %u is not a whole number of inode blocks", sb->inode_count);
+    }
+    if (data_blocks == 0) {
+        report_error("filesystem has no data blocks");
+    }
+    if (sb->next_inode >= sb->inode_count) {
+        report_error("superblock next inode hint %u out of range", sb->next_inode);
+    }
+    if (u64_join(sb->next_block, sb->next_block_hi) >= data_blocks) {
+        report_error("superblock next block hint %llu out of range",
+                     (unsigned long long)u64_join(sb->next_block, sb->next_block_hi));
     }
     if (sb->journal_block != JOURNAL_BLOCK_IDX) {
         report_error("journal block index mismatch %u", sb->journal_block);
     }
-    if (sb->inode_bitmap != INODE_BMAP_IDX) {
+    if (sb->journal_blocks == 0 || (uint64_t)sb->journal_blocks * BLOCK_SIZE > UINT32_MAX) {
+        report_error("journal size %u blocks out of range", sb->journal_blocks);
+    }
+    if (sb->inode_bitmap_blocks != blocks_for_bits(sb->inode_count)) {
+        report_error("inode bitmap size %u blocks does not match %u inodes", sb->inode_bitmap_blocks, sb->inode_count);
+    }
+    if (sb->data_bitmap_blocks != blocks_for_bits(data_blocks)) {
+        report_error("data bitmap size %u blocks does not match %llu data blocks", sb->data_bitmap_blocks,
+                     (unsigned long long)data_blocks);
+    }
+    if ((uint64_t)sb->inode_bitmap != (uint64_t)sb->journal_block + sb->journal_blocks) {
         report_error("inode bitmap index mismatch %u", sb->inode_bitmap);
     }
-    if (sb->data_bitmap != DATA_BMAP_IDX) {
+    if ((uint64_t)sb->data_bitmap != (uint64_t)sb->inode_bitmap + sb->inode_bitmap_blocks) {
         report_error("data bitmap index mismatch %u", sb->data_bitmap);
     }
-    if (sb->inode_start != INODE_START_IDX) {
+    if (sb->blocks_per_group == 0 || sb->blocks_per_group > BITS_PER_BLOCK) {
+        report_error("blocks per group %u out of range", sb->blocks_per_group);
+    } else if (sb->group_count != (data_blocks + sb->blocks_per_group - 1) / sb->blocks_per_group) {
+        report_error("group count %u does not match %llu data blocks", sb->group_count, (unsigned long long)data_blocks);
+    }
+    if (sb->inodes_per_group == 0 || sb->inodes_per_group > BITS_PER_BLOCK) {
+        report_error("inodes per group %u out of range", sb->inodes_per_group);
+    } else if (sb->inodes_per_group % INODES_PER_BLOCK != 0 ||
+               (uint64_t)sb->inodes_per_group * sb->group_count != sb->inode_count) {
+        report_error("inodes per group %u does not divide %u inodes into %u groups",
+                     sb->inodes_per_group, sb->inode_count, sb->group_count);
+    }
+    if ((uint64_t)sb->group_desc_blocks * GROUP_DESCS_PER_BLOCK < sb->group_count ||
+        (sb->group_desc_blocks - 1) * GROUP_DESCS_PER_BLOCK >= sb->group_count) {
+        report_error("group descriptor table size %u blocks does not match %u groups",
+                     sb->group_desc_blocks, sb->group_count);
+    }
+    if ((uint64_t)sb->group_desc != (uint64_t)sb->data_bitmap + sb->data_bitmap_blocks) {
+        report_error("group descriptor index mismatch %u", sb->group_desc);
+    }
+    if ((uint64_t)sb->inode_start != (uint64_t)sb->group_desc + sb->group_desc_blocks) {
         report_error("inode start index mismatch %u", sb->inode_start);
     }
-    if (sb->data_start != DATA_START_IDX) {
+    if ((uint64_t)sb->data_start != (uint64_t)sb->inode_start + sb->inode_count / INODES_PER_BLOCK) {
         report_error("data start index mismatch %u", sb->data_start);
     }
+    if (total_blocks != sb->data_start + data_blocks) {
+        report_error("unexpected total blocks %llu", (unsigned long long)total_blocks);
+    }
+    if (!(sb->features & FEATURE_64BIT) ? total_blocks > UINT32_MAX : total_blocks > MAX_64BIT_BLOCKS) {
+        report_error("total blocks %llu exceed the addressing mode", (unsigned long long)total_blocks);
+    }
+    if ((uint64_t)image_size / BLOCK_SIZE < total_blocks) {
+        report_error("image is %lld bytes, superblock needs %llu blocks", (long long)image_size,
+                     (unsigned long long)total_blocks);
+    }
+    return error_count == before;
+}
+
+static void check_extent_list(const struct extent_header *hdr,
+                              uint32_t inode_index,
+                              uint32_t *next_logical,
+                              uint8_t *data_claimed) {
+    const struct extent *ext = (const struct extent *)(hdr + 1);
+    for (uint32_t e = 0; e < hdr->entries; ++e) {
+        if (ext[e].len == 0) {
+            report_error("inode %u has an empty extent", inode_index);
+            continue;
+        }
+        if (ext[e].logical != *next_logical) {
+            report_error("inode %u extent at file block %u leaves a gap or overlap (expected %u)",
+                         inode_index, ext[e].logical, *next_logical);
+        }
+        if (ext[e].start_hi != 0 && !(geo.features & FEATURE_64BIT)) {
+            report_error("inode %u extent start exceeds 32 bits", inode_index);
+            continue;
+        }
+        uint64_t start = u64_join(ext[e].start, ext[e].start_hi);
+        for (uint32_t b = 0; b < ext[e].len; ++b) {
+            if (!claim_data_block(data_claimed, start + b, inode_index)) {
+                break;
+            }
+        }
+        *next_logical = ext[e].logical + ext[e].len;
+    }
+}
+
+/* Extent-mapped files must map exactly file blocks [0, required_blocks). */
+static void check_extents(int fd,
+                          const struct inode *inode,
+                          uint32_t inode_index,
+                          uint32_t required_blocks,
+                          uint8_t *data_claimed) {
+    const struct extent_header *root = (const struct extent_header *)inode->extent_root;
+    if (inode->type != 1 && inode->type != 2) {
+        report_error("inode %u uses extents but is neither a file nor a directory", inode_index);
+        return;
+    }
+    if (root->magic != EXTENT_MAGIC || root->max != EXTENT_ROOT_ENTRIES ||
+        root->entries > root->max || root->depth > 1) {
+        report_error("inode %u has a malformed extent root", inode_index);
+        return;
+    }
+
+    uint32_t next_logical = 0;
+    if (root->depth == 0) {
+        check_extent_list(root, inode_index, &next_logical, data_claimed);
+    } else {
+        const struct extent_idx *idx = (const struct extent_idx *)(root + 1);
+        uint8_t leaf_block[BLOCK_SIZE];
+        const struct extent_header *leaf = (const struct extent_header *)leaf_block;
+        for (uint32_t i = 0; i < root->entries; ++i) {
+            if (idx[i].leaf_hi != 0 ||
+                !claim_data_block(data_claimed, idx[i].leaf, inode_index)) {
+                continue;
+            }
+            pread_block(fd, idx[i].leaf, leaf_block);
+            if (leaf->magic != EXTENT_MAGIC || leaf->max != EXTENT_LEAF_ENTRIES ||
+                leaf->entries > leaf->max || leaf->depth != 0) {
+                report_error("inode %u extent leaf %u is malformed", inode_index, idx[i].leaf);
+                continue;
+            }
+            if (idx[i].logical != next_logical) {
+                report_error("inode %u extent index entry %u starts at %u (expected %u)",
+                             inode_index, i, idx[i].logical, next_logical);
+            }
+            check_extent_list(leaf, inode_index, &next_logical, data_claimed);
+        }
+    }
+
+    if (next_logical != required_blocks) {
+        report_error("inode %u extents map %u blocks but size %u needs %u",
+                     inode_index, next_logical, inode->size, required_blocks);
+    }
+}
+
+/* Reads the blocks of extent list hdr that fall in directory blocks [0, nblocks). */
+static uint32_t dir_read_extents(int fd, const struct extent_header *hdr, uint32_t inode_index,
+                                 uint32_t nblocks, uint8_t *buf) {
+    const struct extent *ext = (const struct extent *)(hdr + 1);
+    uint32_t mapped = 0;
+    for (uint32_t e = 0; e < hdr->entries; ++e) {
+        uint64_t start = u64_join(ext[e].start, ext[e].start_hi);
+        if (ext[e].logical >= nblocks || start < geo.data_start ||
+            start + ext[e].len > geo.data_start + sb_data_blocks(&geo)) {
+            continue;
+        }
+        if (start + ext[e].len > (1ULL << 32)) {
+            report_error("inode %u directory blocks lie above block %u", inode_index, UINT32_MAX);
+            continue;
+        }
+        uint32_t len = nblocks - ext[e].logical < ext[e].len ? nblocks - ext[e].logical : ext[e].len;
+        pread_blocks(fd, start, len, buf + (size_t)ext[e].logical * BLOCK_SIZE);
+        mapped += len;
+    }
+    return mapped;
+}
+
+/*
+ * Reads directory blocks [0, nblocks) into buf through direct[] or the
+ * extent tree and returns how many are mapped. Malformed extents were
+ * already reported by check_extents; their blocks just count as missing.
+ */
+static uint32_t dir_read_blocks(int fd, const struct inode *inode, uint32_t inode_index,
+                                uint32_t nblocks, uint8_t *buf) {
+    uint32_t mapped = 0;
+    if (!(inode->flags & INODE_FLAG_EXTENTS)) {
+        for (uint32_t b = 0; b < nblocks && b < DIRECT_POINTERS; ++b) {
+            if (inode->direct[b] != 0) {
+                pread_block(fd, inode->direct[b], buf + (size_t)b * BLOCK_SIZE);
+                mapped++;
+            }
+        }
+        return mapped;
+    }
+
+    const struct extent_header *root = (const struct extent_header *)inode->extent_root;
+    if (root->magic != EXTENT_MAGIC || root->entries > EXTENT_ROOT_ENTRIES || root->depth > 1) {
+        return 0;
+    }
+    if (root->depth == 0) {
+        return dir_read_extents(fd, root, inode_index, nblocks, buf);
+    }
+    const struct extent_idx *idx = (const struct extent_idx *)(root + 1);
+    uint8_t leaf_block[BLOCK_SIZE];
+    const struct extent_header *leaf = (const struct extent_header *)leaf_block;
+    for (uint32_t i = 0; i < root->entries; ++i) {
+        if (idx[i].leaf_hi != 0 || idx[i].leaf < geo.data_start ||
+            idx[i].leaf - geo.data_start >= sb_data_blocks(&geo)) {
+            continue;
+        }
+        pread_block(fd, idx[i].leaf, leaf_block);
+        if (leaf->magic == EXTENT_MAGIC && leaf->entries <= EXTENT_LEAF_ENTRIES) {
+            mapped += dir_read_extents(fd, leaf, inode_index, nblocks, buf);
+        }
+    }
+    return mapped;
 }
 
 static void check_directory(int fd,
-                            const struct inode *inode,
+                            const struct inode *inodes,
                             uint32_t inode_index,
                             const uint8_t *inode_used,
                             uint32_t inode_count,
-                            uint32_t *link_refs) {
+                            uint32_t *link_refs,
+                            uint32_t *dir_parent,
+                            uint32_t *dotdot,
+                            uint8_t *bloom) {
+    const struct inode *inode = &inodes[inode_index];
     if (inode->size % sizeof(struct dirent) != 0) {
         report_error("inode %u directory size %u is not dirent-aligned", inode_index, inode->size);
         return;
     }
 
-    uint32_t bytes_remaining = inode->size;
-    uint8_t block[BLOCK_SIZE];
+    uint32_t nslots = inode->size / sizeof(struct dirent);
+    uint32_t nblocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (nblocks > sb_data_blocks(&geo)) {
+        report_error("inode %u directory size %u exceeds the data region", inode_index, inode->size);
+        return;
+    }
+    uint8_t *dir_data = calloc(nblocks + 1, BLOCK_SIZE);
+    if (!dir_data) {
+        die("calloc directory");
+    }
+    if (dir_read_blocks(fd, inode, inode_index, nblocks, dir_data) != nblocks) {
+        report_error("inode %u directory missing data block for bytes still remaining", inode_index);
+        free(dir_data);
+        return;
+    }
+
     int saw_dot = 0;
     int saw_dotdot = 0;
+    const struct dirent *entries = (const struct dirent *)dir_data;
+    for (uint32_t e = 0; e < nslots; ++e) {
+        const struct dirent *de = &entries[e];
+        if (de->inode == 0 && de->name[0] == '\0') {
+            continue;
+        }
+        if (de->inode >= inode_count) {
+            report_error("inode %u directory entry points to out-of-range inode %u", inode_index, de->inode);
+            continue;
+        }
+        if (!inode_used[de->inode]) {
+            report_error("inode %u directory entry references free inode %u", inode_index, de->inode);
+        }
+        if (memchr(de->name, '\0', sizeof(de->name)) == NULL) {
+            report_error("inode %u directory entry has unterminated name", inode_index);
+            continue;
+        }
+        if (de->name[0] == '\0') {
+            report_error("inode %u directory entry has empty name", inode_index);
+            continue;
+        }
+        link_refs[de->inode]++;
+        bloom_add(bloom, de->name);
+        if (strcmp(de->name, ".") == 0) {
+            if (de->inode != inode_index) {
+                report_error("inode %u '.' entry points to %u", inode_index, de->inode);
+            }
+            saw_dot = 1;
+        } else if (strcmp(de->name, "..") == 0) {
+            dotdot[inode_index] = de->inode;
+            saw_dotdot = 1;
+        } else if (inodes[de->inode].type == 2) {
+            if (dir_parent[de->inode] != UINT32_MAX) {
+                report_error("directory inode %u is linked from inodes %u and %u",
+                             de->inode, dir_parent[de->inode], inode_index);
+            }
+            dir_parent[de->inode] = inode_index;
+        }
+    }
+    free(dir_data);
 
-    for (uint32_t i = 0; i < DIRECT_POINTERS && bytes_remaining > 0; ++i) {
-        uint32_t blk = inode->direct[i];
-        if (blk == 0) {
-            report_error("inode %u directory missing data block for bytes still remaining", inode_index);
-            return;
+    if (inode->size > 0) {
+        if (!saw_dot) {
+            report_error("inode %u directory missing '.' entry", inode_index);
         }
-        pread_block(fd, blk, block);
-        uint32_t chunk = bytes_remaining > BLOCK_SIZE ? BLOCK_SIZE : bytes_remaining;
-        uint32_t entries = chunk / sizeof(struct dirent);
-        const struct dirent *entries_ptr = (const struct dirent *)block;
-        for (uint32_t e = 0; e < entries; ++e) {
-            const struct dirent *de = &entries_ptr[e];
-            if (de->inode == 0 && de->name[0] == '\0') {
-                continue;
+        if (!saw_dotdot) {
+            report_error("inode %u directory missing '..' entry", inode_index);
+        }
+    }
+}
+
+static void check_dir_index(int fd,
+                            const struct inode *inode,
+                            uint32_t inode_index,
+                            uint8_t *data_claimed) {
+    if (inode->type != 2) {
+        report_error("inode %u has a directory index but is not a directory", inode_index);
+        return;
+    }
+    if (!claim_data_block(data_claimed, inode->dx_root, inode_index)) {
+        return;
+    }
+
+    uint8_t root_block[BLOCK_SIZE];
+    pread_block(fd, inode->dx_root, root_block);
+    const struct dx_root *root = (const struct dx_root *)root_block;
+    if (root->magic != DX_ROOT_MAGIC) {
+        report_error("inode %u directory index root has bad magic", inode_index);
+        return;
+    }
+    if (root->depth > DX_MAX_DEPTH) {
+        report_error("inode %u directory index depth %u too large", inode_index, root->depth);
+        return;
+    }
+
+    uint32_t nslots = inode->size / sizeof(struct dirent);
+    uint32_t nblocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (nblocks > sb_data_blocks(&geo)) {
+        return;
+    }
+    uint8_t *dir_data = calloc(nblocks + 1, BLOCK_SIZE);
+    uint8_t *indexed = calloc(nslots + 1, 1);
+    if (!dir_data || !indexed) {
+        die("calloc directory index");
+    }
+    dir_read_blocks(fd, inode, inode_index, nblocks, dir_data);
+    const struct dirent *entries = (const struct dirent *)dir_data;
+
+    uint8_t leaf_block[BLOCK_SIZE];
+    const struct dx_leaf *leaf = (const struct dx_leaf *)leaf_block;
+    for (uint32_t i = 0; i < (1U << root->depth); ++i) {
+        uint32_t blk = root->leaves[i];
+        if (blk < geo.data_start || blk - geo.data_start >= sb_data_blocks(&geo)) {
+            report_error("inode %u directory index points outside data region (block %u)", inode_index, blk);
+            continue;
+        }
+        pread_block(fd, blk, leaf_block);
+        if (leaf->magic != DX_LEAF_MAGIC || leaf->depth > root->depth) {
+            report_error("inode %u directory index leaf %u is malformed", inode_index, blk);
+            continue;
+        }
+        uint32_t mask = (1U << leaf->depth) - 1;
+        if ((i & mask) != i) {
+            if (root->leaves[i & mask] != blk) {
+                report_error("inode %u directory index slot %u does not match leaf depth", inode_index, i);
             }
-            if (de->inode >= inode_count) {
-                report_error("inode %u directory entry points to out-of-range inode %u", inode_index, de->inode);
+            continue;
+        }
+        claim_data_block(data_claimed, blk, inode_index);
+        if (leaf->count > DX_LEAF_ENTRIES) {
+            report_error("inode %u directory index leaf %u count %u too large", inode_index, blk, leaf->count);
+            continue;
+        }
+        for (uint32_t e = 0; e < leaf->count; ++e) {
+            const struct dx_entry *dx = &leaf->entries[e];
+            if ((dx->hash & mask) != i) {
+                report_error("inode %u directory index hash 0x%08x filed under wrong leaf", inode_index, dx->hash);
                 continue;
             }
-            if (!inode_used[de->inode]) {
-                report_error("inode %u directory entry references free inode %u", inode_index, de->inode);
-            }
-            if (memchr(de->name, '\0', sizeof(de->name)) == NULL) {
-                report_error("inode %u directory entry has unterminated name", inode_index);
+            if (dx->slot >= nslots) {
+                report_error("inode %u directory index points past directory end (slot %u)", inode_index, dx->slot);
                 continue;
             }
-            if (de->name[0] == '\0') {
-                report_error("inode %u directory entry has empty name", inode_index);
+            const struct dirent *de = &entries[dx->slot];
+            if ((de->inode == 0 && de->name[0] == '\0') || memchr(de->name, '\0', sizeof(de->name)) == NULL) {
+                report_error("inode %u directory index references unused slot %u", inode_index, dx->slot);
                 continue;
             }
-            link_refs[de->inode]++;
-            if (strcmp(de->name, ".") == 0) {
-                if (de->inode != inode_index) {
-                    report_error("inode %u '.' entry points to %u", inode_index, de->inode);
-                }
-                saw_dot = 1;
-            } else if (strcmp(de->name, "..") == 0) {
-                saw_dotdot = 1;
+            if (dx_hash(de->name) != dx->hash) {
+                report_error("inode %u directory index hash mismatch for '%s'", inode_index, de->name);
+            }
+            if (indexed[dx->slot]++) {
+                report_error("inode %u directory index lists slot %u twice", inode_index, dx->slot);
             }
         }
-        bytes_remaining -= chunk;
     }
 
-    if (bytes_remaining != 0) {
-        report_error("inode %u directory uses more data than direct pointers cover", inode_index);
+    for (uint32_t slot = 0; slot < nslots; ++slot) {
+        const struct dirent *de = &entries[slot];
+        if (!(de->inode == 0 && de->name[0] == '\0') && !indexed[slot]) {
+            report_error("inode %u directory entry slot %u missing from index", inode_index, slot);
+        }
     }
-    if (inode->size > 0) {
-        if (!saw_dot) {
-            report_error("inode %u directory missing '.' entry", inode_index);
+
+    free(indexed);
+    free(dir_data);
+}
+
+/*
+ * A filter that lacks bits for a live name would make create accept a
+ * duplicate, so that is an error; extra bits only cost false positives.
+ * With -r any difference is rebuilt, and linear directories without a
+ * filter get one. Indexed directories do not use a filter, so -r drops
+ * one left over from older images.
+ */
+static void check_dir_bloom(struct inode *inode,
+                            uint32_t inode_index,
+                            const uint8_t *expected,
+                            int repair,
+                            uint8_t *inode_blocks_dirty) {
+    int has_filter = (inode->flags & INODE_FLAG_BLOOM) != 0;
+    if (inode->flags & INODE_FLAG_INDEX) {
+        if (has_filter && repair) {
+            memset(inode->bloom, 0, DIR_BLOOM_BYTES);
+            inode->flags &= ~INODE_FLAG_BLOOM;
+            inode_blocks_dirty[inode_index / INODES_PER_BLOCK] = 1;
+            printf("Dropped Bloom filter of indexed directory inode %u\n", inode_index);
         }
-        if (!saw_dotdot) {
-            report_error("inode %u directory missing '..' entry", inode_index);
+        return;
+    }
+    if (has_filter && memcmp(inode->bloom, expected, DIR_BLOOM_BYTES) == 0) {
+        return;
+    }
+    if (repair) {
+        memcpy(inode->bloom, expected, DIR_BLOOM_BYTES);
+        inode->flags |= INODE_FLAG_BLOOM;
+        inode_blocks_dirty[inode_index / INODES_PER_BLOCK] = 1;
+        printf("Rebuilt Bloom filter of directory inode %u\n", inode_index);
+        return;
+    }
+    if (!has_filter) {
+        return;
+    }
+    for (uint32_t b = 0; b < DIR_BLOOM_BYTES; ++b) {
+        if (expected[b] & ~inode->bloom[b]) {
+            report_error("inode %u Bloom filter is stale (misses directory names)", inode_index);
+            return;
         }
     }
 }
 
 int main(int argc, char *argv[]) {
-    const char *image_path = (argc > 1) ? argv[1] : DEFAULT_IMAGE;
+    int repair = 0;
+    int argi = 1;
+    if (argc > argi && strcmp(argv[argi], "-r") == 0) {
+        repair = 1;
+        argi++;
+    }
+    const char *image_path = (argc > argi) ? argv[argi] : DEFAULT_IMAGE;
 
-    int fd = open(image_path, O_RDONLY);
+    int fd = open(image_path, repair ? O_RDWR : O_RDONLY);
     if (fd < 0) {
         die("open");
     }
 
     struct superblock sb;
-    pread_block(fd, 0, &sb);
-    validate_superblock(&sb);
+    if (pread(fd, &sb, sizeof(sb), 0) != (ssize_t)sizeof(sb)) {
+        die("pread");
+    }
+    off_t image_size = lseek(fd, 0, SEEK_END);
+    if (image_size < 0) {
+        die("lseek");
+    }
+    if (!validate_superblock(&sb, image_size)) {
+        close(fd);
+        fprintf(stderr, "%d inconsistencies found.\n", error_count);
+        return 1;
+    }
+    geo = sb;
+    hole_map_build(fd, image_size);
 
-    uint8_t inode_bitmap[BLOCK_SIZE];
-    uint8_t data_bitmap[BLOCK_SIZE];
-    pread_block(fd, INODE_BMAP_IDX, inode_bitmap);
-    pread_block(fd, DATA_BMAP_IDX, data_bitmap);
+    uint8_t *inode_bitmap = malloc((size_t)sb.inode_bitmap_blocks * BLOCK_SIZE);
+    uint8_t *data_bitmap = malloc((size_t)sb.data_bitmap_blocks * BLOCK_SIZE);
+    if (!inode_bitmap || !data_bitmap) {
+        die("malloc bitmaps");
+    }
+    pread_blocks(fd, sb.inode_bitmap, sb.inode_bitmap_blocks, inode_bitmap);
+    pread_blocks(fd, sb.data_bitmap, sb.data_bitmap_blocks, data_bitmap);
+
+    struct group_desc *groups = malloc((size_t)sb.group_desc_blocks * BLOCK_SIZE);
+    if (!groups) {
+        die("malloc group descriptors");
+    }
+    pread_blocks(fd, sb.group_desc, sb.group_desc_blocks, (uint8_t *)groups);
 
     uint32_t inode_count = sb.inode_count;
-    uint32_t total_inode_bytes = INODE_BLOCKS * BLOCK_SIZE;
-    uint8_t *inode_area = malloc(total_inode_bytes);
+    uint32_t inode_blocks = inode_count / INODES_PER_BLOCK;
+    uint8_t *inode_area = malloc((size_t)inode_blocks * BLOCK_SIZE);
     if (!inode_area) {
         die("malloc inode area");
     }
-    for (uint32_t i = 0; i < INODE_BLOCKS; ++i) {
-        pread_block(fd, INODE_START_IDX + i, inode_area + (i * BLOCK_SIZE));
+    /* Uninitialized slices hold whatever was on disk before mkfs; they count as empty. */
+    uint32_t group_itable_blocks = sb.inodes_per_group / INODES_PER_BLOCK;
+    for (uint32_t g = 0; g < sb.group_count; g++) {
+        uint8_t *slice = inode_area + (size_t)g * group_itable_blocks * BLOCK_SIZE;
+        if (groups[g].flags & ~GROUP_INODE_UNINIT) {
+            report_error("group %u has unknown flags 0x%x", g, groups[g].flags);
+        }
+        if (groups[g].flags & GROUP_INODE_UNINIT) {
+            if (g == 0) {
+                report_error("group 0 holding the root has an uninitialized inode table");
+            }
+            if (groups[g].free_inodes != sb.inodes_per_group) {
+                report_error("group %u has allocated inodes but an uninitialized inode table", g);
+            }
+            memset(slice, 0, (size_t)group_itable_blocks * BLOCK_SIZE);
+        } else {
+            pread_blocks(fd, sb.inode_start + g * group_itable_blocks, group_itable_blocks, slice);
+        }
     }
     struct inode *inodes = (struct inode *)inode_area;
-
-    uint8_t inode_used[inode_count];
+    uint8_t *inode_blocks_dirty = calloc(inode_blocks, 1);
+    uint8_t *inode_used = malloc(inode_count);
+    if (!inode_blocks_dirty || !inode_used) {
+        die("malloc inode state");
+    }
     for (uint32_t i = 0; i < inode_count; ++i) {
         inode_used[i] = (inodes[i].type != 0);
     }
@@ -238,11 +983,20 @@ int main(int argc, char *argv[]) {
     if (!link_refs) {
         die("calloc link refs");
     }
+    uint32_t *dir_parent = malloc(inode_count * sizeof(uint32_t));
+    uint32_t *dotdot = malloc(inode_count * sizeof(uint32_t));
+    if (!dir_parent || !dotdot) {
+        die("malloc directory parents");
+    }
+    memset(dir_parent, 0xFF, inode_count * sizeof(uint32_t));
+    memset(dotdot, 0xFF, inode_count * sizeof(uint32_t));
 
-    int data_owner[DATA_BLOCKS];
-    memset(data_owner, -1, sizeof(data_owner));
-    uint8_t data_blocks_referenced[DATA_BLOCKS];
-    memset(data_blocks_referenced, 0, sizeof(data_blocks_referenced));
+    /* One bit per data block, laid out like the data bitmap so the two compare word by word. */
+    uint64_t data_blocks = sb_data_blocks(&sb);
+    uint8_t *data_claimed = calloc(sb.data_bitmap_blocks, BLOCK_SIZE);
+    if (!data_claimed) {
+        die("calloc claimed data blocks");
+    }
 
     for (uint32_t i = 0; i < inode_count; ++i) {
         struct inode *ino = &inodes[i];
@@ -261,30 +1015,35 @@ int main(int argc, char *argv[]) {
         }
 
         uint32_t required_blocks = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-        if (required_blocks > DIRECT_POINTERS) {
+        if (ino->flags & INODE_FLAG_INLINE) {
+            if (ino->type != 1) {
+                report_error("inode %u has inline data but is not a regular file", i);
+            }
+            if (ino->flags & (INODE_FLAG_EXTENTS | INODE_FLAG_INDEX | INODE_FLAG_BLOOM)) {
+                report_error("inode %u has inline data and conflicting flags 0x%x", i, ino->flags);
+            }
+            if (ino->size > INLINE_DATA_MAX) {
+                report_error("inode %u inline size %u exceeds %u bytes", i, ino->size, (unsigned)INLINE_DATA_MAX);
+            }
+            continue;
+        }
+        if (ino->flags & INODE_FLAG_EXTENTS) {
+            check_extents(fd, ino, i, required_blocks, data_claimed);
+        } else if (required_blocks > DIRECT_POINTERS) {
             report_error("inode %u size %u exceeds direct pointers", i, ino->size);
         }
 
         uint32_t seen_blocks = 0;
-        for (uint32_t d = 0; d < DIRECT_POINTERS; ++d) {
+        for (uint32_t d = 0; d < DIRECT_POINTERS && !(ino->flags & INODE_FLAG_EXTENTS); ++d) {
             uint32_t blk = ino->direct[d];
             if (blk == 0) {
                 continue;
             }
             seen_blocks++;
-            if (blk < DATA_START_IDX || blk >= DATA_START_IDX + DATA_BLOCKS) {
-                report_error("inode %u points outside data region (block %u)", i, blk);
-                continue;
-            }
-            uint32_t data_idx = blk - DATA_START_IDX;
-            if (data_owner[data_idx] != -1 && data_owner[data_idx] != (int)i) {
-                report_error("data block %u referenced by both inode %d and inode %u", blk, data_owner[data_idx], i);
-            }
-            data_owner[data_idx] = (int)i;
-            data_blocks_referenced[data_idx] = 1;
+            claim_data_block(data_claimed, blk, i);
         }
 
-        if (seen_blocks < required_blocks) {
+        if (seen_blocks < required_blocks && !(ino->flags & INODE_FLAG_EXTENTS)) {
             report_error("inode %u lacks blocks for declared size (need %u have %u)", i, required_blocks, seen_blocks);
         }
         if (required_blocks == 0 && seen_blocks > 0) {
@@ -292,7 +1051,15 @@ int main(int argc, char *argv[]) {
         }
 
         if (ino->type == 2) {
-            check_directory(fd, ino, i, inode_used, inode_count, link_refs);
+            uint8_t bloom[DIR_BLOOM_BYTES];
+            memset(bloom, 0, sizeof(bloom));
+            check_directory(fd, inodes, i, inode_used, inode_count, link_refs, dir_parent, dotdot, bloom);
+            check_dir_bloom(ino, i, bloom, repair, inode_blocks_dirty);
+        } else if (ino->flags & INODE_FLAG_BLOOM) {
+            report_error("inode %u has a Bloom filter but is not a directory", i);
+        }
+        if (ino->flags & INODE_FLAG_INDEX) {
+            check_dir_index(fd, ino, i, data_claimed);
         }
     }
 
@@ -303,6 +1070,15 @@ int main(int argc, char *argv[]) {
         if (inodes[i].links != link_refs[i]) {
             report_error("inode %u link count %u disagrees with directory refs %u", i, inodes[i].links, link_refs[i]);
         }
+        if (inodes[i].type != 2 || dotdot[i] == UINT32_MAX) {
+            continue;
+        }
+        uint32_t expected_parent = i == 0 ? 0 : dir_parent[i];
+        if (expected_parent == UINT32_MAX) {
+            report_error("directory inode %u is not linked from any directory", i);
+        } else if (dotdot[i] != expected_parent) {
+            report_error("directory inode %u '..' points to %u, expected %u", i, dotdot[i], expected_parent);
+        }
     }
 
     for (uint32_t bit = 0; bit < inode_count; ++bit) {
@@ -314,19 +1090,72 @@ int main(int argc, char *argv[]) {
             report_error("inode bitmap misses allocated inode %u", bit);
         }
     }
-    bitmap_check_zero_tail(inode_bitmap, inode_count, "inode");
+    bitmap_check_zero_tail(inode_bitmap, sb.inode_bitmap_blocks, inode_count, "inode");
 
-    for (uint32_t bit = 0; bit < DATA_BLOCKS; ++bit) {
-        int bit_val = bitmap_test(data_bitmap, bit);
-        if (bit_val && !data_blocks_referenced[bit]) {
-            report_error("data bitmap marks block %u used but no inode references it", bit + DATA_START_IDX);
+    for (uint64_t word = 0; word < (data_blocks + 63) / 64; ++word) {
+        uint64_t used, claimed;
+        memcpy(&used, data_bitmap + word * 8, sizeof(used));
+        memcpy(&claimed, data_claimed + word * 8, sizeof(claimed));
+        if (used == claimed) {
+            continue;
         }
-        if (!bit_val && data_blocks_referenced[bit]) {
-            report_error("data block %u referenced but bitmap is clear", bit + DATA_START_IDX);
+        for (uint64_t bit = word * 64; bit < (word + 1) * 64 && bit < data_blocks; ++bit) {
+            int bit_val = bitmap_test(data_bitmap, bit);
+            if (bit_val && !bitmap_test(data_claimed, bit)) {
+                report_error("data bitmap marks block %llu used but no inode references it",
+                             (unsigned long long)(bit + sb.data_start));
+            }
+            if (!bit_val && bitmap_test(data_claimed, bit)) {
+                report_error("data block %llu referenced but bitmap is clear", (unsigned long long)(bit + sb.data_start));
+            }
+        }
+    }
+
+    bitmap_check_zero_tail(data_bitmap, sb.data_bitmap_blocks, data_blocks, "data");
+
+    uint8_t journal_block[BLOCK_SIZE];
+    pread_block(fd, sb.journal_block, journal_block);
+    const struct journal_header *jhdr = (const struct journal_header *)journal_block;
+    check_holes(data_bitmap, jhdr->magic == JOURNAL_MAGIC && jhdr->nbytes_used > sizeof(*jhdr));
+
+    /* Per-group counts must match the bitmaps and the directories actually found. */
+    for (uint32_t g = 0; g < sb.group_count; ++g) {
+        uint32_t group_free_inodes = 0, group_dirs = 0, group_free_blocks = 0;
+        for (uint32_t i = g * sb.inodes_per_group; i < (g + 1) * sb.inodes_per_group; ++i) {
+            group_free_inodes += !bitmap_test(inode_bitmap, i);
+            group_dirs += inode_used[i] && inodes[i].type == 2;
+        }
+        uint64_t first = (uint64_t)g * sb.blocks_per_group;
+        uint64_t end = data_blocks - first < sb.blocks_per_group ? data_blocks : first + sb.blocks_per_group;
+        group_free_blocks = (uint32_t)bitmap_count_clear(data_bitmap, first, end);
+        if (groups[g].free_inodes != group_free_inodes) {
+            report_error("group %u free inode count %u disagrees with bitmap %u", g, groups[g].free_inodes, group_free_inodes);
+        }
+        if (groups[g].free_blocks != group_free_blocks) {
+            report_error("group %u free block count %u disagrees with bitmap %u", g, groups[g].free_blocks, group_free_blocks);
+        }
+        if (groups[g].dirs != group_dirs) {
+            report_error("group %u directory count %u disagrees with inodes %u", g, groups[g].dirs, group_dirs);
+        }
+    }
+
+    for (uint32_t i = 0; i < inode_blocks; ++i) {
+        if (inode_blocks_dirty[i]) {
+            pwrite_block(fd, sb.inode_start + i, inode_area + ((size_t)i * BLOCK_SIZE));
         }
     }
 
-    bitmap_check_zero_tail(data_bitmap, DATA_BLOCKS, "data");
+    free(data_claimed);
+    free(dotdot);
+    free(dir_parent);
+    free(link_refs);
+    free(inode_used);
+    free(inode_blocks_dirty);
+    free(inode_area);
+    free(groups);
+    free(data_bitmap);
+    free(inode_bitmap);
+    hole_map_free();
 
     if (close(fd) < 0) {
         die("close");
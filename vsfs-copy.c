@@ -0,0 +1,380 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FS_MAGIC 0x56534653U
+#define JOURNAL_MAGIC 0x4A524E4CU
+
+#define MIN_BLOCK_SIZE     1024U
+#define MAX_BLOCK_SIZE    65536U
+#define BLOCK_SIZE        block_size
+#define INODE_SIZE         128U
+#define INODES_PER_BLOCK   (BLOCK_SIZE / INODE_SIZE)
+#define BITS_PER_BLOCK     (BLOCK_SIZE * 8U)
+#define JOURNAL_BLOCK_IDX    1U
+#define GROUP_DESCS_PER_BLOCK (BLOCK_SIZE / sizeof(struct group_desc))
+#define GROUP_INODE_UNINIT  0x1U
+#define MAX_64BIT_BLOCKS   (1ULL << 48)
+
+#define FEATURE_64BIT      0x1U
+#define FEATURE_DISCARD    0x2U
+#define FEATURE_KNOWN      (FEATURE_64BIT | FEATURE_DISCARD)
+
+/* Largest run of blocks read or written with one call. */
+#define COPY_CHUNK_BYTES (1U << 20)
+
+struct superblock {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t inode_count;
+
+    uint32_t journal_block;
+    uint32_t inode_bitmap;
+    uint32_t data_bitmap;
+    uint32_t inode_start;
+    uint32_t data_start;
+
+    uint32_t journal_blocks;
+    uint32_t inode_bitmap_blocks;
+    uint32_t data_bitmap_blocks;
+    uint32_t data_blocks;
+
+    uint32_t group_count;
+    uint32_t inodes_per_group;
+    uint32_t blocks_per_group;
+    uint32_t group_desc;
+    uint32_t group_desc_blocks;
+
+    uint32_t features;
+    uint32_t total_blocks_hi;
+    uint32_t data_blocks_hi;
+
+    uint32_t next_inode;
+    uint32_t next_block;
+    uint32_t next_block_hi;
+
+    uint8_t  _pad[128 - 24 * 4];
+};
+
+struct group_desc {
+    uint32_t free_inodes;
+    uint32_t free_blocks;
+    uint32_t dirs;
+    uint32_t flags;
+};
+
+struct journal_header {
+    uint32_t magic;
+    uint32_t nbytes_used;
+};
+
+_Static_assert(sizeof(struct superblock) == 128, "superblock must be 128 bytes");
+
+static uint32_t block_size;
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static void pread_exact(int fd, void *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            die("pread");
+        }
+        buf = (uint8_t *)buf + n;
+        len -= (size_t)n;
+        offset += n;
+    }
+}
+
+static void pwrite_exact(int fd, const void *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            die("pwrite");
+        }
+        buf = (const uint8_t *)buf + n;
+        len -= (size_t)n;
+        offset += n;
+    }
+}
+
+static int bitmap_test(const uint8_t *bitmap, uint64_t index) {
+    return (bitmap[index / 8] >> (index % 8)) & 0x1;
+}
+
+static uint64_t u64_join(uint32_t lo, uint32_t hi) {
+    return (uint64_t)hi << 32 | lo;
+}
+
+static uint32_t blocks_for_bits(uint64_t bits) {
+    return (uint32_t)((bits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK);
+}
+
+/* The same layout checks journal applies before trusting a superblock. */
+static int check_geometry(const struct superblock *sb, off_t image_size) {
+    uint64_t total_blocks = u64_join(sb->total_blocks, sb->total_blocks_hi);
+    uint64_t data_blocks = u64_join(sb->data_blocks, sb->data_blocks_hi);
+    uint32_t inode_blocks = sb->inode_count / INODES_PER_BLOCK;
+
+    if (!(sb->features & FEATURE_64BIT) && (sb->total_blocks_hi | sb->data_blocks_hi) != 0) {
+        return -1;
+    }
+    if (sb->journal_blocks == 0 || (uint64_t)sb->journal_blocks * BLOCK_SIZE > UINT32_MAX ||
+        sb->inode_count == 0 || sb->inode_count % INODES_PER_BLOCK != 0 || data_blocks == 0) {
+        return -1;
+    }
+    if (sb->inode_bitmap_blocks != blocks_for_bits(sb->inode_count) ||
+        sb->data_bitmap_blocks != blocks_for_bits(data_blocks)) {
+        return -1;
+    }
+    if (sb->blocks_per_group == 0 || sb->blocks_per_group > BITS_PER_BLOCK ||
+        sb->group_count != (data_blocks + sb->blocks_per_group - 1) / sb->blocks_per_group ||
+        sb->inodes_per_group == 0 || sb->inodes_per_group > BITS_PER_BLOCK ||
+        (uint64_t)sb->inodes_per_group * sb->group_count != sb->inode_count ||
+        sb->inodes_per_group % INODES_PER_BLOCK != 0 ||
+        (uint64_t)sb->group_desc_blocks * GROUP_DESCS_PER_BLOCK < sb->group_count) {
+        return -1;
+    }
+    if (sb->journal_block != JOURNAL_BLOCK_IDX ||
+        (uint64_t)sb->inode_bitmap != (uint64_t)sb->journal_block + sb->journal_blocks ||
+        (uint64_t)sb->data_bitmap != (uint64_t)sb->inode_bitmap + sb->inode_bitmap_blocks ||
+        (uint64_t)sb->group_desc != (uint64_t)sb->data_bitmap + sb->data_bitmap_blocks ||
+        (uint64_t)sb->inode_start != (uint64_t)sb->group_desc + sb->group_desc_blocks ||
+        (uint64_t)sb->data_start != (uint64_t)sb->inode_start + inode_blocks ||
+        total_blocks != sb->data_start + data_blocks) {
+        return -1;
+    }
+    if (total_blocks > ((sb->features & FEATURE_64BIT) ? MAX_64BIT_BLOCKS : UINT32_MAX) ||
+        (uint64_t)image_size / BLOCK_SIZE < total_blocks) {
+        return -1;
+    }
+    return 0;
+}
+
+static int block_is_zero(const uint8_t *block) {
+    return block[0] == 0 && memcmp(block, block + 1, BLOCK_SIZE - 1) == 0;
+}
+
+/*
+ * What the copy may leave out. A block no tool ever reads can become a
+ * hole: journal space past the last record, and the inode-table slices
+ * of groups still flagged GROUP_INODE_UNINIT, which are zeroed before
+ * first use. Free
+ * data blocks are skipped too, but only while the journal is empty,
+ * since ordered-mode data of a committed transaction sits in blocks the
+ * home bitmap still shows free until install.
+ */
+struct copy_plan {
+    struct superblock sb;
+    uint64_t journal_end;     /* first journal block past the records */
+    struct group_desc *groups;
+    uint8_t *data_bitmap;     /* NULL when free data blocks must be copied */
+};
+
+static void plan_copy(int fd, off_t image_size, struct copy_plan *plan) {
+    struct superblock *sb = &plan->sb;
+    pread_exact(fd, sb, sizeof(*sb), 0);
+    if (sb->magic != FS_MAGIC || sb->block_size < MIN_BLOCK_SIZE || sb->block_size > MAX_BLOCK_SIZE ||
+        (sb->block_size & (sb->block_size - 1)) != 0 || (sb->features & ~FEATURE_KNOWN)) {
+        fprintf(stderr, "Error: source is not a supported VSFS image\n");
+        exit(EXIT_FAILURE);
+    }
+    block_size = sb->block_size;
+    if (check_geometry(sb, image_size) < 0) {
+        fprintf(stderr, "Error: source superblock has a corrupt layout\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct journal_header jhdr;
+    pread_exact(fd, &jhdr, sizeof(jhdr), (off_t)sb->journal_block * BLOCK_SIZE);
+    int journal_empty = jhdr.magic != JOURNAL_MAGIC || jhdr.nbytes_used <= sizeof(jhdr);
+    uint64_t journal_used = journal_empty ? 1 : ((uint64_t)jhdr.nbytes_used + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    plan->journal_end = sb->journal_block + (journal_used < sb->journal_blocks ? journal_used : sb->journal_blocks);
+
+    /* The home descriptors suffice: a slice whose flag is cleared only in the journal holds just zeros at home. */
+    plan->groups = malloc((size_t)sb->group_desc_blocks * BLOCK_SIZE);
+    if (!plan->groups) {
+        die("malloc group descriptors");
+    }
+    pread_exact(fd, plan->groups, (size_t)sb->group_desc_blocks * BLOCK_SIZE, (off_t)sb->group_desc * BLOCK_SIZE);
+
+    plan->data_bitmap = NULL;
+    if (journal_empty) {
+        plan->data_bitmap = malloc((size_t)sb->data_bitmap_blocks * BLOCK_SIZE);
+        if (!plan->data_bitmap) {
+            die("malloc data bitmap");
+        }
+        pread_exact(fd, plan->data_bitmap, (size_t)sb->data_bitmap_blocks * BLOCK_SIZE,
+                    (off_t)sb->data_bitmap * BLOCK_SIZE);
+    }
+}
+
+static int plan_skips(const struct copy_plan *plan, uint64_t blk) {
+    const struct superblock *sb = &plan->sb;
+    if (blk >= plan->journal_end && blk < (uint64_t)sb->journal_block + sb->journal_blocks) {
+        return 1;
+    }
+    if (blk >= sb->inode_start && blk < sb->data_start) {
+        uint64_t g = (blk - sb->inode_start) / (sb->inodes_per_group / INODES_PER_BLOCK);
+        return (plan->groups[g].flags & GROUP_INODE_UNINIT) != 0;
+    }
+    if (blk >= sb->data_start && plan->data_bitmap) {
+        uint64_t bit = blk - sb->data_start;
+        uint64_t data_blocks = u64_join(sb->data_blocks, sb->data_blocks_hi);
+        return bit < data_blocks && !bitmap_test(plan->data_bitmap, bit);
+    }
+    return 0;
+}
+
+/*
+ * Whether an all-zero block may be left as a hole. Data blocks may not:
+ * an in-use block that is a hole looks lost to the validator, and with
+ * a journal still pending the home bitmap cannot tell which are in use.
+ * Free data blocks the plan skips are holes anyway.
+ */
+static int zero_is_hole(const struct copy_plan *plan, uint64_t blk) {
+    return blk < plan->sb.data_start;
+}
+
+/*
+ * Copies blocks [first, end), which the source holds as data. Blocks the
+ * plan skips are not read, and all-zero metadata blocks are not written,
+ * so both stay holes in the destination. Returns the number of blocks
+ * written.
+ */
+static uint64_t copy_region(int src, int dst, const struct copy_plan *plan, uint64_t first, uint64_t end,
+                            off_t image_size, uint8_t *buf) {
+    uint64_t written = 0;
+    uint64_t chunk = COPY_CHUNK_BYTES / BLOCK_SIZE;
+    uint64_t blk = first;
+    while (blk < end) {
+        if (plan_skips(plan, blk)) {
+            blk++;
+            continue;
+        }
+        uint64_t run = 1;
+        while (blk + run < end && run < chunk && !plan_skips(plan, blk + run)) {
+            run++;
+        }
+
+        /* The image may end inside its last block. */
+        off_t offset = (off_t)(blk * BLOCK_SIZE);
+        size_t len = (size_t)run * BLOCK_SIZE;
+        if (offset + (off_t)len > image_size) {
+            len = (size_t)(image_size - offset);
+            memset(buf + len, 0, (size_t)run * BLOCK_SIZE - len);
+        }
+        pread_exact(src, buf, len, offset);
+
+        for (uint64_t i = 0; i < run;) {
+            if (zero_is_hole(plan, blk + i) && block_is_zero(buf + i * BLOCK_SIZE)) {
+                i++;
+                continue;
+            }
+            uint64_t j = i + 1;
+            while (j < run && !(zero_is_hole(plan, blk + j) && block_is_zero(buf + j * BLOCK_SIZE))) {
+                j++;
+            }
+            size_t out = (size_t)(j - i) * BLOCK_SIZE;
+            if (offset + (off_t)(j * BLOCK_SIZE) > image_size) {
+                out = (size_t)(image_size - offset - (off_t)(i * BLOCK_SIZE));
+            }
+            pwrite_exact(dst, buf + i * BLOCK_SIZE, out, offset + (off_t)(i * BLOCK_SIZE));
+            written += j - i;
+            i = j;
+        }
+        blk += run;
+    }
+    return written;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <source image> <destination image>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    const char *src_path = argv[1];
+    const char *dst_path = argv[2];
+
+    int src = open(src_path, O_RDONLY);
+    if (src < 0) {
+        die("open source");
+    }
+    struct stat src_st, dst_st;
+    if (fstat(src, &src_st) < 0) {
+        die("fstat");
+    }
+    if (stat(dst_path, &dst_st) == 0 && dst_st.st_dev == src_st.st_dev && dst_st.st_ino == src_st.st_ino) {
+        fprintf(stderr, "Error: source and destination are the same file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct copy_plan plan;
+    plan_copy(src, src_st.st_size, &plan);
+
+    int dst = open(dst_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dst < 0) {
+        die("open destination");
+    }
+    off_t image_size = src_st.st_size;
+    if (ftruncate(dst, image_size) < 0) {
+        die("ftruncate");
+    }
+
+    uint8_t *buf = malloc(COPY_CHUNK_BYTES);
+    if (!buf) {
+        die("malloc copy buffer");
+    }
+
+    /* Walk the source's data regions; its holes are never read. */
+    uint64_t written = 0;
+    off_t pos = 0;
+    while (pos < image_size) {
+        off_t data = lseek(src, pos, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) {
+            break;
+        }
+        off_t hole = data < 0 ? image_size : lseek(src, data, SEEK_HOLE);
+        if (data < 0) {
+            data = pos;     /* No hole reporting: the rest is one region. */
+        }
+        if (hole < 0) {
+            die("lseek");
+        }
+        written += copy_region(src, dst, &plan, (uint64_t)data / BLOCK_SIZE,
+                               ((uint64_t)hole + BLOCK_SIZE - 1) / BLOCK_SIZE, image_size, buf);
+        pos = hole;
+    }
+
+    if (fsync(dst) < 0) {
+        die("fsync");
+    }
+    if (close(dst) < 0) {
+        die("close");
+    }
+    close(src);
+    free(buf);
+    free(plan.groups);
+    free(plan.data_bitmap);
+
+    uint64_t total = ((uint64_t)image_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    printf("Copied '%s' to '%s' (%llu of %llu blocks written).\n", src_path, dst_path,
+           (unsigned long long)written, (unsigned long long)total);
+    return 0;
+}